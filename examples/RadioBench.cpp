@@ -0,0 +1,319 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+/*
+ * Host benchmark (Linux) for the per packet CPU cost of the security
+ * and checksum code. Build from the library directory:
+ *   g++ -O2 -DFEATURE_LORA -Isrc -Iutil examples/RadioBench.cpp src/RadioSecurity.cpp \
+ *       src/RadioSecurityAESNI.cpp util/rs_aes.c util/rs_sha256.c util/rs_datasum.c -o radiobench
+ *   ./radiobench [label] > results.json
+ *
+ * Every result is one JSON object per line:
+ *   {"label":"v4.1.0","bench":"aes_ecb_encrypt","impl":"soft","bytes":16,
+ *    "ns_per_op":123.4,"ops_per_sec":8103727,"cycles_per_byte":25.1}
+ * cycles_per_byte uses the x86 time stamp counter, it is null on other CPUs.
+ *
+ * The send_v1/recv_v1 and send_v2/recv_v2 benchmarks run the same steps as
+ * RadioShuttle::SendMessage/ReceiveMessage for encrypted packets (data sum,
+ * copy into the TX buffer, padding, encryption, and the reverse), without
+ * the radio driver which is not available on Linux hosts.
+ */
+
+#if defined(__linux__) && !defined(__MBED__) && !defined(ARDUINO)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "RadioSecurityInterface.h"
+#include "RadioSecurity.h"
+#include "RadioSecurityAESNI.h"
+#include "rs_aes.h"
+#include "rs_sha256.h"
+#include "rs_datasum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES()	__rdtsc()
+#endif
+
+static const int RadioMTU = 255;		// SX1276 LoRa MTU
+static const int RadioHeaderSize = 16;	// RSHeaderFullySize_v1
+static const int EncHeaderSize = 8;		// sizeof(EncryptionHeader)
+static const int DataSumBits = 13;
+static const int SeqSize = 4;			// SecuritySeqSize_v2
+static const int TagSize = 4;			// SecurityTagSize_v2
+static const uint64_t MinRunNs = 50000000; // 50 ms per result
+
+static const char *label = "";
+
+struct BenchCase {
+    RadioSecurityInterface *sec;
+    void *context;
+    AES_CTX *aesctx;
+    uint8_t data[RadioMTU];
+    uint8_t buf[RadioMTU];
+    uint8_t frame[RadioMTU];
+    int len;
+};
+
+typedef void (*BenchFunc)(BenchCase *bc);
+
+
+static uint64_t
+NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Runs the function until MinRunNs passed, the iterations
+ * double each round to keep the timer overhead small.
+ */
+static void
+Run(const char *bench, const char *impl, BenchFunc func, BenchCase *bc, int bytes)
+{
+    uint64_t iterations = 1, ns = 0, cycles = 0;
+
+    func(bc); // warm up caches
+    for (;;) {
+        uint64_t start = NowNs();
+#ifdef BENCH_CYCLES
+        uint64_t c = BENCH_CYCLES();
+#endif
+        for (uint64_t i = 0; i < iterations; i++)
+            func(bc);
+#ifdef BENCH_CYCLES
+        cycles = BENCH_CYCLES() - c;
+#endif
+        ns = NowNs() - start;
+        if (ns >= MinRunNs)
+            break;
+        iterations *= 2;
+    }
+
+    double nsPerOp = (double)ns / iterations;
+    printf("{\"label\":\"%s\",\"bench\":\"%s\",\"impl\":\"%s\",\"bytes\":%d,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,",
+           label, bench, impl, bytes, nsPerOp, 1e9 / nsPerOp);
+#ifdef BENCH_CYCLES
+    printf("\"cycles_per_byte\":%.2f}\n", (double)cycles / iterations / (bytes > 0 ? bytes : 1));
+#else
+    (void)cycles;
+    printf("\"cycles_per_byte\":null}\n");
+#endif
+}
+
+
+static int
+BlockLen(int len)
+{
+    return (len + AES128_KEYLEN - 1) / AES128_KEYLEN * AES128_KEYLEN;
+}
+
+static void
+EcbEncrypt(BenchCase *bc)
+{
+    bc->sec->EncryptMessage(bc->context, bc->data, bc->buf, BlockLen(bc->len));
+}
+
+static void
+EcbDecrypt(BenchCase *bc)
+{
+    bc->sec->DecryptMessage(bc->context, bc->data, bc->buf, BlockLen(bc->len));
+}
+
+static void
+CbcEncrypt(BenchCase *bc)
+{
+    AES128_CBC_encrypt_buffer(bc->aesctx, bc->buf, bc->data, BlockLen(bc->len));
+}
+
+static void
+CbcDecrypt(BenchCase *bc)
+{
+    AES128_CBC_decrypt_buffer(bc->aesctx, bc->buf, bc->data, BlockLen(bc->len));
+}
+
+static void
+HashPassword(BenchCase *bc)
+{
+    bc->sec->HashPassword(bc->data, 8, bc->data + 8, bc->len, bc->buf);
+}
+
+static void
+VerifyBatch(BenchCase *bc)
+{
+    RadioSecurityInterface::VerifyJob jobs[SHA256_LANES];
+    for (int i = 0; i < SHA256_LANES; i++) {
+        jobs[i].seed = bc->data + i;
+        jobs[i].seedLen = 8;
+        jobs[i].password = bc->data + 8;
+        jobs[i].pwLen = bc->len;
+        jobs[i].hash = bc->frame;
+    }
+    bc->sec->VerifyPasswordBatch(jobs, SHA256_LANES);
+}
+
+static void
+DataSum(BenchCase *bc)
+{
+    bc->buf[0] = rs_datasum_fold(DataSumBits, rs_datasum_add(0, bc->data, bc->len, NULL));
+}
+
+
+/*
+ * Version 1: header + data padded to the block size, ECB in place
+ */
+static void
+SendV1(BenchCase *bc)
+{
+    uint8_t *tx = bc->frame + RadioHeaderSize;
+    int newlen = BlockLen(EncHeaderSize + bc->len);
+    uint32_t sum = rs_datasum_fold(DataSumBits, rs_datasum_add(0, bc->data, bc->len, tx + EncHeaderSize));
+    memcpy(tx, &sum, sizeof(sum));
+    memset(tx + 4, 0x55, EncHeaderSize - 4);
+    memset(tx + EncHeaderSize + bc->len, 0, newlen - (EncHeaderSize + bc->len));
+    bc->sec->EncryptMessage(bc->context, tx, tx, newlen);
+}
+
+static void
+RecvV1(BenchCase *bc)
+{
+    int bsize = AES128_KEYLEN;
+    int cryptlen = BlockLen(EncHeaderSize + bc->len);
+    int dataEnd = EncHeaderSize + bc->len;
+    uint8_t *rx = bc->buf;
+
+    memcpy(rx, bc->frame + RadioHeaderSize, cryptlen); // the radio RX ring copy
+    bc->sec->DecryptMessage(bc->context, rx, rx, bsize);
+    uint32_t sum = rs_datasum_add(0, rx + EncHeaderSize, (dataEnd < bsize ? dataEnd : bsize) - EncHeaderSize, NULL);
+    for (int off = bsize; off < cryptlen; off += 4 * bsize) {
+        int chunk = cryptlen - off < 4 * bsize ? cryptlen - off : 4 * bsize;
+        bc->sec->DecryptMessage(bc->context, rx + off, rx + off, chunk);
+        if (off < dataEnd)
+            sum = rs_datasum_add(sum, rx + off, chunk < dataEnd - off ? chunk : dataEnd - off, NULL);
+    }
+    bc->data[0] ^= rs_datasum_fold(DataSumBits, sum) == 0xffff; // keep the result alive
+}
+
+/*
+ * Version 2: sequence, data and tag, authenticated encryption without padding
+ */
+static void
+SendV2(BenchCase *bc)
+{
+    uint8_t *tx = bc->frame + RadioHeaderSize;
+    uint8_t nonce[12];
+    memset(nonce, 0x11, sizeof(nonce));
+    memset(tx, 0x22, SeqSize);
+    memcpy(tx + SeqSize, bc->data, bc->len);
+    bc->sec->EncryptAuthMessage(bc->context, nonce, sizeof(nonce), bc->frame, RadioHeaderSize,
+                                tx + SeqSize, bc->len, tx + SeqSize + bc->len, TagSize);
+}
+
+static void
+RecvV2(BenchCase *bc)
+{
+    uint8_t nonce[12];
+    uint8_t *rx = bc->buf;
+    memset(nonce, 0x11, sizeof(nonce));
+    memcpy(rx, bc->frame, RadioHeaderSize + SeqSize + bc->len + TagSize);
+    if (!bc->sec->DecryptAuthMessage(bc->context, nonce, sizeof(nonce), rx, RadioHeaderSize,
+                                     rx + RadioHeaderSize + SeqSize, bc->len, rx + RadioHeaderSize + SeqSize + bc->len, TagSize))
+        bc->data[0] ^= 1;
+}
+
+
+static void
+RunSecurity(RadioSecurityInterface *sec, const char *impl)
+{
+    static BenchCase bc;
+    static const int sizes[] = { 1, 8, 16, 32, 64, 128, 192, 216, 231 };
+    static const int pwSizes[] = { 8, 16, 32, 64 };
+    uint8_t key[AES128_KEYLEN];
+
+    for (int i = 0; i < RadioMTU; i++)
+        bc.data[i] = (uint8_t)(i * 13 + 7);
+    memset(key, 0x5a, sizeof(key));
+    bc.sec = sec;
+    bc.context = sec->CreateEncryptionContext(key, sizeof(key));
+    bc.aesctx = NULL;
+
+    int maxV1 = ((RadioMTU - RadioHeaderSize) / AES128_KEYLEN) * AES128_KEYLEN - EncHeaderSize;
+    int maxV2 = RadioMTU - RadioHeaderSize - SeqSize - TagSize;
+    for (unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bc.len = sizes[i];
+        Run("aes_ecb_encrypt", impl, EcbEncrypt, &bc, BlockLen(bc.len));
+        Run("aes_ecb_decrypt", impl, EcbDecrypt, &bc, BlockLen(bc.len));
+        if (bc.len <= maxV1) {
+            SendV1(&bc);
+            Run("send_v1", impl, SendV1, &bc, bc.len);
+            Run("recv_v1", impl, RecvV1, &bc, bc.len);
+        }
+        if (bc.len <= maxV2) {
+            memset(bc.frame, 0x33, RadioHeaderSize);
+            SendV2(&bc);
+            Run("send_v2", impl, SendV2, &bc, bc.len);
+            Run("recv_v2", impl, RecvV2, &bc, bc.len);
+        }
+    }
+    for (unsigned int i = 0; i < sizeof(pwSizes)/sizeof(pwSizes[0]); i++) {
+        bc.len = pwSizes[i];
+        Run("hash_password", impl, HashPassword, &bc, 8 + bc.len);
+        Run("verify_password_batch", impl, VerifyBatch, &bc, SHA256_LANES * (8 + bc.len));
+    }
+    sec->DestroyEncryptionContext(bc.context);
+}
+
+
+static void
+RunPortable(void)
+{
+    static BenchCase bc;
+    static const int sizes[] = { 1, 8, 16, 32, 64, 128, 192, 239 };
+    uint8_t key[AES128_KEYLEN];
+    uint8_t iv[AES128_KEYLEN];
+
+    for (int i = 0; i < RadioMTU; i++)
+        bc.data[i] = (uint8_t)(i * 13 + 7);
+    memset(key, 0x5a, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+
+    AES_CTX aesctx;
+    bc.aesctx = &aesctx;
+    for (unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bc.len = sizes[i];
+        AES128_InitContext(&aesctx, key, iv);
+        Run("aes_cbc_encrypt", "soft", CbcEncrypt, &bc, BlockLen(bc.len));
+        Run("aes_cbc_decrypt", "soft", CbcDecrypt, &bc, BlockLen(bc.len));
+        Run("data_sum", "soft", DataSum, &bc, bc.len);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1)
+        label = argv[1];
+
+    RadioSecurity soft;
+    RunSecurity(&soft, "soft");
+#ifdef RS_AESNI_AVAILABLE
+    if (RadioSecurityAESNI::IsSupported()) {
+        RadioSecurityAESNI aesni;
+        if (aesni.SelfTest())
+            RunSecurity(&aesni, "aesni");
+    }
+#endif
+    RunPortable();
+    return 0;
+}
+
+#endif // __linux__
@@ -0,0 +1,132 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#define FEATURE_LORA	1
+#include "arduino-util.h"
+#endif
+
+#ifdef __MBED__
+#include "mbed.h"
+#include "xPinMap.h"
+#endif
+
+#ifdef FEATURE_LORA
+
+#include <stdint.h>
+#include <string.h>
+#include "RadioCompressionInterface.h"
+#include "RadioCompression.h"
+
+#include "rs_lzss.h"
+
+#ifndef DPRINTF_AVAILABLE
+#define	dprintf(...)	void()
+#define	dump(a,b,c)		void()
+#endif
+
+RadioCompression::RadioCompression(void)
+{
+    memset(_dicts, 0, sizeof(_dicts));
+}
+
+RadioCompression::~RadioCompression(void)
+{
+}
+
+int
+RadioCompression::GetCompressionVersion(void)
+{
+    return _compressionVers;
+}
+
+
+bool
+RadioCompression::SetDictionary(int AppID, const void *dict, int dictLen)
+{
+    DictEntry *dep = NULL;
+    
+    for (int i = 0; i < _maxDictionaries; i++) {
+        if (_dicts[i].dict && _dicts[i].AppID == AppID) {
+            dep = &_dicts[i];
+            break;
+        }
+        if (!_dicts[i].dict && !dep)
+            dep = &_dicts[i];
+    }
+    if (!dep)
+        return dict == NULL;
+    
+    /*
+     * Matches reach back LZSS_WINDOW bytes, the beginning
+     * of a larger dictionary would never be used.
+     */
+    if (dict && dictLen > LZSS_WINDOW) {
+        dict = (const uint8_t *)dict + dictLen - LZSS_WINDOW;
+        dictLen = LZSS_WINDOW;
+    }
+    dep->AppID = AppID;
+    dep->dict = (const uint8_t *)dict;
+    dep->dictLen = dict ? dictLen : 0;
+    return true;
+}
+
+
+const RadioCompression::DictEntry *
+RadioCompression::FindDictionary(int AppID)
+{
+    for (int i = 0; i < _maxDictionaries; i++) {
+        if (_dicts[i].dict && _dicts[i].AppID == AppID)
+            return &_dicts[i];
+    }
+    return NULL;
+}
+
+
+int
+RadioCompression::Compress(int AppID, const void *input, int len, void *output, int maxLen)
+{
+    const DictEntry *d = FindDictionary(AppID);
+    
+    return rs_lzss_compress(d ? d->dict : NULL, d ? d->dictLen : 0, (const uint8_t *)input, len, (uint8_t *)output, maxLen);
+}
+
+
+int
+RadioCompression::Decompress(int AppID, const void *input, int len, void *output, int maxLen)
+{
+    const DictEntry *d = FindDictionary(AppID);
+    
+    return rs_lzss_decompress(d ? d->dict : NULL, d ? d->dictLen : 0, (const uint8_t *)input, len, (uint8_t *)output, maxLen);
+}
+
+
+void
+RadioCompression::CompressionTest(void)
+{
+    const char dict[] = "{\"temp\":,\"hum\":,\"bat\":}";
+    const char msg[] = "{\"temp\":21.5,\"hum\":45,\"bat\":3.71}";
+    const int testAppID = -1;
+    uint8_t packed[sizeof(msg)];
+    uint8_t buffer[sizeof(msg)];
+    
+    dprintf("LZSS compress/decompress: ");
+    SetDictionary(testAppID, dict, sizeof(dict) - 1);
+    int len = Compress(testAppID, msg, sizeof(msg) - 1, packed, sizeof(packed));
+    int outLen = -1;
+    if (len > 0)
+        outLen = Decompress(testAppID, packed, len, buffer, sizeof(buffer));
+    SetDictionary(testAppID, NULL, 0);
+    
+    if (outLen == (int)sizeof(msg) - 1 && memcmp(buffer, msg, outLen) == 0) {
+        dprintf("SUCCESS! (%d -> %d bytes)", outLen, len);
+    } else {
+        dprintf("FAILURE!");
+    }
+}
+
+#endif // FEATURE_LORA
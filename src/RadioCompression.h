@@ -0,0 +1,45 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef __RADIOCOMPRESSION_H__
+#define __RADIOCOMPRESSION_H__
+
+/*
+ * LZSS compression for small memory footprints, no buffers are allocated.
+ * Short messages have little repetition, a static dictionary per app
+ * with typical message content (e.g. the JSON keys or sample payloads
+ * of the sensors, the most frequent at the end) improves the ratio.
+ */
+class RadioCompression : public RadioCompressionInterface {
+public:
+    RadioCompression();
+    virtual ~RadioCompression();
+    virtual int GetCompressionVersion(void);
+    virtual int Compress(int AppID, const void *input, int len, void *output, int maxLen);
+    virtual int Decompress(int AppID, const void *input, int len, void *output, int maxLen);
+    virtual void CompressionTest(void);
+    
+    /*
+     * Sets the dictionary for an AppID, the data is not copied and must
+     * stay valid (e.g. a const array). The station and the nodes must use
+     * the same dictionary, up to 1 kB is used. NULL removes it.
+     */
+    bool SetDictionary(int AppID, const void *dict, int dictLen);
+    
+private:
+    struct DictEntry {
+        int AppID;
+        const uint8_t *dict;
+        int dictLen;
+    };
+    const DictEntry *FindDictionary(int AppID);
+    
+    static int const _compressionVers = 1;
+    static int const _maxDictionaries = 4;
+    DictEntry _dicts[_maxDictionaries];
+};
+
+#endif // __RADIOCOMPRESSION_H__
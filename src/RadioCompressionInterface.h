@@ -0,0 +1,37 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef __RADIOCOMPRESSIONINTERFACE_H__
+#define __RADIOCOMPRESSIONINTERFACE_H__
+
+class RadioCompressionInterface {
+public:
+    virtual ~RadioCompressionInterface() { }
+
+    /*
+     * The compression format version (1-255), it is sent in front
+     * of compressed messages, 0 marks uncompressed messages.
+     */
+    virtual int GetCompressionVersion(void) = 0;
+    
+    /*
+     * Compresses the message of an AppID into the output, the AppID allows
+     * implementations to use a dictionary per app.
+     * Returns the compressed size or -1 if it exceeds maxLen,
+     * in this case the message is sent uncompressed.
+     */
+    virtual int Compress(int AppID, const void *input, int len, void *output, int maxLen) = 0;
+    
+    /*
+     * Decompresses a message, returns the size or -1 for invalid
+     * data or if the result exceeds maxLen.
+     */
+    virtual int Decompress(int AppID, const void *input, int len, void *output, int maxLen) = 0;
+    
+    virtual void CompressionTest(void) = 0;
+};
+
+#endif // __RADIOCOMPRESSIONINTERFACE_H__
@@ -0,0 +1,178 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef __RADIOPOOL_H__
+#define __RADIOPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+/*
+ * A fixed-capacity pool of equally sized memory blocks.
+ * All blocks are allocated once via Reserve(), Alloc() and Free() use a bitmap
+ * of the blocks and do not use the heap, this avoids heap fragmentation on
+ * long running nodes. Larger requests get contiguous blocks.
+ * Without a Reserve() the pool is empty and all allocations go to the heap.
+ */
+class RadioPool {
+public:
+    /*
+     * Space for the list/tree node links added by the STL to every entry
+     */
+    static const int NodeOverhead = 4 * sizeof(void *);
+
+    RadioPool() : _mem(NULL), _map(NULL), _blockSize(0), _count(0), _used(0) { }
+    ~RadioPool() { delete[] _mem; delete[] _map; }
+
+    /*
+     * Allocates the pool with count blocks of blockSize bytes.
+     * A pool in use cannot be changed, a count of 0 disables the pool.
+     */
+    bool Reserve(int count, int blockSize) {
+        if (_used)
+            return false;
+        delete[] _mem;
+        delete[] _map;
+        _mem = NULL;
+        _map = NULL;
+        _count = 0;
+        if (count <= 0)
+            return true;
+
+        _blockSize = (blockSize + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+        _mem = new uint8_t[count * _blockSize];
+        _map = new uint32_t[(count + 31) / 32];
+        if (!_mem || !_map) {
+            delete[] _mem;
+            delete[] _map;
+            _mem = NULL;
+            _map = NULL;
+            return false;
+        }
+        for (int i = 0; i < (count + 31) / 32; i++)
+            _map[i] = 0;
+        _count = count;
+        return true;
+    }
+
+    /*
+     * Returns contiguous blocks for size bytes, NULL if the pool
+     * is empty or has not enough free blocks.
+     */
+    void *Alloc(size_t size) {
+        int n = Blocks(size);
+        if (!_mem || n > _count - _used)
+            return NULL;
+        int run = 0;
+        for (int i = 0; i < _count; i++) {
+            if (!(i & 31) && _map[i >> 5] == 0xffffffff) {
+                run = 0;
+                i += 31; // all used
+                continue;
+            }
+            if (_map[i >> 5] & (1UL << (i & 31))) {
+                run = 0;
+                continue;
+            }
+            if (++run == n) {
+                int first = i - n + 1;
+                for (int j = first; j <= i; j++)
+                    _map[j >> 5] |= 1UL << (j & 31);
+                _used += n;
+                return _mem + first * _blockSize;
+            }
+        }
+        return NULL;
+    }
+
+    /*
+     * Returns false if the memory is not part of the pool,
+     * the size must match the Alloc() size.
+     */
+    bool Free(void *p, size_t size) {
+        if (!Contains(p))
+            return false;
+        int first = ((uint8_t *)p - _mem) / _blockSize;
+        int n = Blocks(size);
+        for (int j = first; j < first + n && j < _count; j++)
+            _map[j >> 5] &= ~(1UL << (j & 31));
+        _used -= n;
+        return true;
+    }
+
+    /*
+     * A reserved pool without free blocks is exhausted,
+     * a pool which has never been reserved uses the heap.
+     */
+    bool Exhausted(void) { return _mem && _used >= _count; }
+    bool Contains(void *p) { return _mem && (uint8_t *)p >= _mem && (uint8_t *)p < _mem + _count * _blockSize; }
+    int Capacity(void) { return _count; }
+    int Used(void) { return _used; }
+
+private:
+    int Blocks(size_t size) { return size > _blockSize ? (size + _blockSize - 1) / _blockSize : 1; }
+
+    uint8_t *_mem;
+    uint32_t *_map;	// Bit per block, set if used
+    size_t _blockSize;
+    int _count;
+    int _used;
+};
+
+
+/*
+ * STL allocator for the RadioShuttle lists which gets its
+ * memory from a RadioPool. A reserved pool never falls back to the
+ * heap, the RadioShuttle checks Exhausted() before every insert.
+ * Without a reserved pool the heap is used.
+ */
+template <class T> class RadioPoolAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U> struct rebind {
+        typedef RadioPoolAllocator<U> other;
+    };
+
+    RadioPoolAllocator(RadioPool *pool = NULL) throw() : _pool(pool) { }
+    template <class U> RadioPoolAllocator(const RadioPoolAllocator<U> &a) throw() : _pool(a._pool) { }
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void *hint = 0) {
+        (void)hint;
+        if (_pool && _pool->Capacity())
+            return (pointer)_pool->Alloc(n * sizeof(T)); // NULL if exhausted
+        return (pointer)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(pointer p, size_type n) {
+        if (!_pool || !_pool->Free(p, n * sizeof(T)))
+            ::operator delete(p);
+    }
+
+    size_type max_size() const throw() { return ((size_t)-1) / sizeof(T); }
+    void construct(pointer p, const T &val) { new((void *)p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+
+    RadioPool *_pool;
+};
+
+template <class T, class U>
+inline bool operator==(const RadioPoolAllocator<T> &a, const RadioPoolAllocator<U> &b) { return a._pool == b._pool; }
+
+template <class T, class U>
+inline bool operator!=(const RadioPoolAllocator<T> &a, const RadioPoolAllocator<U> &b) { return a._pool != b._pool; }
+
+#endif // __RADIOPOOL_H__
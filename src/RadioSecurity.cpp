@@ -17,6 +17,8 @@
 
 #ifdef FEATURE_LORA
 
+#include <stdint.h>
+#include <string.h>
 #include "RadioSecurityInterface.h"
 #include "RadioSecurity.h"
 
@@ -52,18 +54,58 @@ RadioSecurity::GetHashBlockSize(void)
 void
 RadioSecurity::HashPassword(void *seed, int seedLen, void *password, int pwLen, void *hashResult)
 {
-    SHA256_CTX *shactx = (SHA256_CTX *)new uint8_t[sizeof(SHA256_CTX)];
-	if (!shactx)
-        return;
+    SHA256_CTX shactx; // per call, the interface may be shared
     
-    sha256_init(shactx);
+    sha256_init(&shactx);
     if (seedLen)
-        sha256_update(shactx, (BYTE *)seed, seedLen);
+        sha256_update(&shactx, (BYTE *)seed, seedLen);
     if (password)
-        sha256_update(shactx, (BYTE *)password, pwLen);
-    sha256_final(shactx, (BYTE *)hashResult);
+        sha256_update(&shactx, (BYTE *)password, pwLen);
+    sha256_final(&shactx, (BYTE *)hashResult);
+    memset(&shactx, 0, sizeof(shactx)); // no password data left on the stack
+}
+
+
+bool
+RadioSecurity::VerifyPassword(void *seed, int seedLen, void *password, int pwLen, const void *hash)
+{
+    BYTE result[SHA256_BLOCK_SIZE];
+    uint8_t diff = 0;
     
-    delete[] shactx;
+    HashPassword(seed, seedLen, password, pwLen, result);
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) // constant time compare
+        diff |= result[i] ^ ((const BYTE *)hash)[i];
+    memset(result, 0, sizeof(result));
+    return diff == 0;
+}
+
+
+void
+RadioSecurity::VerifyPasswordBatch(VerifyJob *jobs, int count)
+{
+    SHA256_JOB shajobs[SHA256_LANES];
+    BYTE results[SHA256_LANES][SHA256_BLOCK_SIZE];
+    
+    while (count > 0) {
+        int lanes = count < SHA256_LANES ? count : SHA256_LANES;
+        for (int i = 0; i < lanes; i++) {
+            shajobs[i].data[0] = (const BYTE *)jobs[i].seed;
+            shajobs[i].len[0] = jobs[i].seed ? jobs[i].seedLen : 0;
+            shajobs[i].data[1] = (const BYTE *)jobs[i].password;
+            shajobs[i].len[1] = jobs[i].password ? jobs[i].pwLen : 0;
+            shajobs[i].hash = results[i];
+        }
+        sha256_multi(shajobs, lanes);
+        for (int i = 0; i < lanes; i++) {
+            uint8_t diff = 0;
+            for (int n = 0; n < SHA256_BLOCK_SIZE; n++) // constant time compare
+                diff |= results[i][n] ^ ((const BYTE *)jobs[i].hash)[n];
+            jobs[i].verified = diff == 0;
+        }
+        jobs += lanes;
+        count -= lanes;
+    }
+    memset(results, 0, sizeof(results));
 }
 
 
@@ -102,6 +144,27 @@ RadioSecurity::DestroyEncryptionContext(void *context)
 }
 
 
+int
+RadioSecurity::GetEncryptionContextSize(void)
+{
+    return sizeof(AES_CTX);
+}
+
+
+void *
+RadioSecurity::InitEncryptionContext(void *memory, void *key, int keyLen)
+{
+    uint8_t mykey[AES128_KEYLEN];
+    
+    memset(mykey, 0, sizeof(mykey));
+    memcpy(mykey, key, keyLen  > AES128_KEYLEN ? AES128_KEYLEN : keyLen);
+    AES128_InitContext((AES_CTX *)memory, mykey, NULL);
+    memset(mykey, 0, sizeof(mykey));
+    
+    return memory;
+}
+
+
 void
 RadioSecurity::EncryptMessage(void *context, const void *input, void *output, int len)
 {
@@ -129,16 +192,130 @@ RadioSecurity::DecryptMessage(void *context, const void *input, void *output, in
     }
 }
 
+void
+RadioSecurity::AuthNonce(const void *nonce, int nonceLen, uint8_t *block)
+{
+    memset(block, 0, AES128_KEYLEN);
+    memcpy(block, nonce, nonceLen > _authNonceSize ? _authNonceSize : nonceLen);
+}
+
+
+void
+RadioSecurity::AuthMac(void *context, const uint8_t *nonce, const uint8_t *aad, int aadLen, const uint8_t *data, int len, uint8_t *mac)
+{
+    /*
+     * The first block contains the nonce and the lengths, the 0x80 marker
+     * separates it from the counter blocks which use the same nonce.
+     */
+    memcpy(mac, nonce, AES128_KEYLEN);
+    mac[_authNonceSize] = 0x80;
+    mac[_authNonceSize+1] = aadLen;
+    mac[_authNonceSize+2] = len >> 8;
+    mac[_authNonceSize+3] = len;
+    EncryptMessage(context, mac, mac, AES128_KEYLEN);
+
+    for (int off = 0; off < aadLen; off += AES128_KEYLEN) {
+        for (int i = 0; i < AES128_KEYLEN && off + i < aadLen; i++)
+            mac[i] ^= aad[off + i];
+        EncryptMessage(context, mac, mac, AES128_KEYLEN);
+    }
+    for (int off = 0; off < len; off += AES128_KEYLEN) {
+        for (int i = 0; i < AES128_KEYLEN && off + i < len; i++)
+            mac[i] ^= data[off + i];
+        EncryptMessage(context, mac, mac, AES128_KEYLEN);
+    }
+}
+
+
+void
+RadioSecurity::AuthCtr(void *context, const uint8_t *nonce, uint8_t *data, int len, uint8_t *tagMask)
+{
+    /*
+     * Up to four counter blocks are encrypted in one EncryptMessage call,
+     * which lets a pipelined implementation (AES-NI) work on them together.
+     */
+    uint8_t stream[4 * AES128_KEYLEN];
+    uint32_t count = 0;
+    int off = -AES128_KEYLEN; // counter 0 masks the tag
+
+    while (off < len) {
+        int n;
+        for (n = 0; n < 4 && off + n * AES128_KEYLEN < len; n++, count++) {
+            uint8_t *ctr = stream + n * AES128_KEYLEN;
+            memcpy(ctr, nonce, AES128_KEYLEN);
+            ctr[_authNonceSize] = count >> 24;
+            ctr[_authNonceSize+1] = count >> 16;
+            ctr[_authNonceSize+2] = count >> 8;
+            ctr[_authNonceSize+3] = count;
+        }
+        EncryptMessage(context, stream, stream, n * AES128_KEYLEN);
+        for (int b = 0; b < n; b++, off += AES128_KEYLEN) {
+            uint8_t *key = stream + b * AES128_KEYLEN;
+            if (off < 0) {
+                memcpy(tagMask, key, AES128_KEYLEN);
+                continue;
+            }
+            for (int i = 0; i < AES128_KEYLEN && off + i < len; i++)
+                data[off + i] ^= key[i];
+        }
+    }
+    memset(stream, 0, sizeof(stream));
+}
+
+
+bool
+RadioSecurity::EncryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, void *tag, int tagLen)
+{
+    uint8_t n[AES128_KEYLEN];
+    uint8_t mac[AES128_KEYLEN];
+    uint8_t mask[AES128_KEYLEN];
+
+    if (tagLen <= 0 || tagLen > AES128_KEYLEN || aadLen > 0xff || len > 0xffff)
+        return false;
+
+    AuthNonce(nonce, nonceLen, n);
+    AuthMac(context, n, (const uint8_t *)aad, aadLen, (const uint8_t *)data, len, mac);
+    AuthCtr(context, n, (uint8_t *)data, len, mask);
+    for (int i = 0; i < tagLen; i++)
+        ((uint8_t *)tag)[i] = mac[i] ^ mask[i];
+    return true;
+}
+
+
+bool
+RadioSecurity::DecryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, const void *tag, int tagLen)
+{
+    uint8_t n[AES128_KEYLEN];
+    uint8_t mac[AES128_KEYLEN];
+    uint8_t mask[AES128_KEYLEN];
+    uint8_t diff = 0;
+
+    if (tagLen <= 0 || tagLen > AES128_KEYLEN || aadLen > 0xff || len > 0xffff)
+        return false;
+
+    AuthNonce(nonce, nonceLen, n);
+    AuthCtr(context, n, (uint8_t *)data, len, mask);
+    AuthMac(context, n, (const uint8_t *)aad, aadLen, (const uint8_t *)data, len, mac);
+    for (int i = 0; i < tagLen; i++) // constant time compare
+        diff |= ((const uint8_t *)tag)[i] ^ mac[i] ^ mask[i];
+    return diff == 0;
+}
+
+
 void
 RadioSecurity::EncryptTest(void)
 {
     uint8_t key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
     uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+    /*
+     * The ECB and CBC tests use the software AES context, the AUTH test
+     * uses the (derived) EncryptMessage.
+     */
     
     {
         
         dprintf("ECB encrypt: ");
-        void *context = CreateEncryptionContext(key, sizeof(key));
+        void *context = RadioSecurity::CreateEncryptionContext(key, sizeof(key));
         
         // static void test_encrypt_ecb(void)
         uint8_t in[]  = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
@@ -155,12 +332,12 @@ RadioSecurity::EncryptTest(void)
         } else {
             dprintf("FAILURE!");
         }
-        DestroyEncryptionContext(context);
+        RadioSecurity::DestroyEncryptionContext(context);
     }
     
     {
         dprintf("ECB decrypt: ");
-        void *context = CreateEncryptionContext(key, sizeof(key));
+        void *context = RadioSecurity::CreateEncryptionContext(key, sizeof(key));
 
         uint8_t in[]  = {0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97};
         uint8_t out[] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
@@ -173,13 +350,13 @@ RadioSecurity::EncryptTest(void)
         } else {
             dprintf("FAILURE!");
         }
-        DestroyEncryptionContext(context);
+        RadioSecurity::DestroyEncryptionContext(context);
     }
 
     
     {
         dprintf("CBC encrypt: ");
-        void *context = CreateEncryptionContext(key, sizeof(key), iv, sizeof(iv));
+        void *context = RadioSecurity::CreateEncryptionContext(key, sizeof(key), iv, sizeof(iv));
 
         uint8_t in[]  = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
             0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
@@ -201,12 +378,12 @@ RadioSecurity::EncryptTest(void)
         } else     {
             dprintf("FAILURE!");
         }
-        DestroyEncryptionContext(context);
+        RadioSecurity::DestroyEncryptionContext(context);
     }
     
     {
         dprintf("CBC decrypt: ");
-        void *context = CreateEncryptionContext(key, sizeof(key), iv, sizeof(iv));
+        void *context = RadioSecurity::CreateEncryptionContext(key, sizeof(key), iv, sizeof(iv));
 
         uint8_t in[]  = { 0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
             0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
@@ -229,6 +406,38 @@ RadioSecurity::EncryptTest(void)
         } else {
             dprintf("FAILURE!");
         }
+        RadioSecurity::DestroyEncryptionContext(context);
+    }
+
+    {
+        dprintf("AUTH encrypt/decrypt: ");
+        void *context = CreateEncryptionContext(key, sizeof(key));
+
+        uint8_t aad[] = { 0x01, 0x02, 0x03, 0x04 };
+        uint8_t in[]  = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+            0xae, 0x2d, 0x8a };
+        uint8_t buffer[sizeof(in)];
+        uint8_t tag[4];
+        bool ok = true;
+
+        memcpy(buffer, in, sizeof(in));
+        EncryptAuthMessage(context, iv, _authNonceSize, aad, sizeof(aad), buffer, sizeof(buffer), tag, sizeof(tag));
+        if (memcmp(buffer, in, sizeof(in)) == 0)
+            ok = false;
+        if (!DecryptAuthMessage(context, iv, _authNonceSize, aad, sizeof(aad), buffer, sizeof(buffer), tag, sizeof(tag)))
+            ok = false;
+        if (memcmp(buffer, in, sizeof(in)) != 0)
+            ok = false;
+        EncryptAuthMessage(context, iv, _authNonceSize, aad, sizeof(aad), buffer, sizeof(buffer), tag, sizeof(tag));
+        aad[0] ^= 1; // a modified header must fail
+        if (DecryptAuthMessage(context, iv, _authNonceSize, aad, sizeof(aad), buffer, sizeof(buffer), tag, sizeof(tag)))
+            ok = false;
+
+        if (ok) {
+            dprintf("SUCCESS!");
+        } else {
+            dprintf("FAILURE!");
+        }
         DestroyEncryptionContext(context);
     }
 }
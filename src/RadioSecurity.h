@@ -18,15 +18,30 @@ public:
      */
     virtual	int GetHashBlockSize(void);
     virtual	void HashPassword(void *seed, int seedLen, void *password, int pwLen, void *hashResult);
+    virtual bool VerifyPassword(void *seed, int seedLen, void *password, int pwLen, const void *hash);
+    virtual void VerifyPasswordBatch(VerifyJob *jobs, int count);
     
     virtual	int GetEncryptionBlockSize(void);
     virtual void *CreateEncryptionContext(void *key, int keyLen, void *seed = NULL, int seedlen = 0);
     virtual void DestroyEncryptionContext(void *context);
+    virtual int GetEncryptionContextSize(void);
+    virtual void *InitEncryptionContext(void *memory, void *key, int keyLen);
     virtual	void EncryptMessage(void *context, const void *input, void *output, int len);
     virtual void DecryptMessage(void *context, const void *input, void *output, int len);
+    virtual bool EncryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, void *tag, int tagLen);
+    virtual bool DecryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, const void *tag, int tagLen);
     virtual void EncryptTest(void);
 private:
-    static int const _securityVers = 1;
+    /*
+     * CCM like mode built on EncryptMessage, CTR encryption and a CBC-MAC
+     * over the nonce, the additional data and the cleartext.
+     */
+    void AuthMac(void *context, const uint8_t *nonce, const uint8_t *aad, int aadLen, const uint8_t *data, int len, uint8_t *mac);
+    void AuthCtr(void *context, const uint8_t *nonce, uint8_t *data, int len, uint8_t *tagMask);
+    void AuthNonce(const void *nonce, int nonceLen, uint8_t *block);
+
+    static int const _securityVers = 2;
+    static int const _authNonceSize = 12;
 };
 
 #endif // RadioSecurity.h
@@ -0,0 +1,338 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#define FEATURE_LORA	1
+#include "arduino-util.h"
+#endif
+
+#ifdef __MBED__
+#include "mbed.h"
+#include "xPinMap.h"
+#endif
+
+#ifdef FEATURE_LORA
+
+#include <stdint.h>
+#include <string.h>
+#include "RadioSecurityInterface.h"
+#include "RadioSecurity.h"
+#include "RadioSecurityAESNI.h"
+
+#ifdef RS_AESNI_AVAILABLE
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include "rs_aes.h"
+
+#ifndef DPRINTF_AVAILABLE
+#define	dprintf(...)	void()
+#define	dump(a,b,c)		void()
+#endif
+
+#define AESNI_TARGET	__attribute__((target("sse2,aes")))
+
+/*
+ * The round keys are stored unaligned, they get loaded into
+ * registers once per message.
+ */
+struct AESNI_CTX {
+    uint8_t encKey[(Nr + 1) * AES128_KEYLEN];
+    uint8_t decKey[(Nr + 1) * AES128_KEYLEN];
+};
+
+
+AESNI_TARGET static inline __m128i
+KeyExpandStep(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define KEY_EXPAND(i, rcon)	rk[i] = KeyExpandStep(rk[i-1], _mm_aeskeygenassist_si128(rk[i-1], rcon))
+
+AESNI_TARGET static void
+AESNIKeySetup(AESNI_CTX *ctx, const uint8_t *key)
+{
+    __m128i rk[Nr + 1];
+
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    KEY_EXPAND(1, 0x01);
+    KEY_EXPAND(2, 0x02);
+    KEY_EXPAND(3, 0x04);
+    KEY_EXPAND(4, 0x08);
+    KEY_EXPAND(5, 0x10);
+    KEY_EXPAND(6, 0x20);
+    KEY_EXPAND(7, 0x40);
+    KEY_EXPAND(8, 0x80);
+    KEY_EXPAND(9, 0x1b);
+    KEY_EXPAND(10, 0x36);
+
+    /*
+     * The decryption keys are in reverse order with InvMixColumns
+     * applied to the inner rounds (equivalent inverse cipher)
+     */
+    for (int i = 0; i <= Nr; i++) {
+        __m128i dk = rk[Nr - i];
+        if (i > 0 && i < Nr)
+            dk = _mm_aesimc_si128(dk);
+        _mm_storeu_si128((__m128i *)(ctx->encKey + i * AES128_KEYLEN), rk[i]);
+        _mm_storeu_si128((__m128i *)(ctx->decKey + i * AES128_KEYLEN), dk);
+    }
+}
+
+
+/*
+ * Processes four blocks at a time to fill the AES unit pipeline,
+ * the remaining blocks are done one by one.
+ */
+AESNI_TARGET static void
+AESNIEncrypt(const uint8_t *keys, const uint8_t *in, uint8_t *out, int len)
+{
+    __m128i rk[Nr + 1];
+    int off = 0;
+
+    for (int r = 0; r <= Nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i *)(keys + r * AES128_KEYLEN));
+
+    for (; off + 4 * AES128_KEYLEN <= len; off += 4 * AES128_KEYLEN) {
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off)), rk[0]);
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 16)), rk[0]);
+        __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 32)), rk[0]);
+        __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 48)), rk[0]);
+        for (int r = 1; r < Nr; r++) {
+            b0 = _mm_aesenc_si128(b0, rk[r]);
+            b1 = _mm_aesenc_si128(b1, rk[r]);
+            b2 = _mm_aesenc_si128(b2, rk[r]);
+            b3 = _mm_aesenc_si128(b3, rk[r]);
+        }
+        _mm_storeu_si128((__m128i *)(out + off), _mm_aesenclast_si128(b0, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 16), _mm_aesenclast_si128(b1, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 32), _mm_aesenclast_si128(b2, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 48), _mm_aesenclast_si128(b3, rk[Nr]));
+    }
+    for (; off < len; off += AES128_KEYLEN) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off)), rk[0]);
+        for (int r = 1; r < Nr; r++)
+            b = _mm_aesenc_si128(b, rk[r]);
+        _mm_storeu_si128((__m128i *)(out + off), _mm_aesenclast_si128(b, rk[Nr]));
+    }
+}
+
+
+AESNI_TARGET static void
+AESNIDecrypt(const uint8_t *keys, const uint8_t *in, uint8_t *out, int len)
+{
+    __m128i rk[Nr + 1];
+    int off = 0;
+
+    for (int r = 0; r <= Nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i *)(keys + r * AES128_KEYLEN));
+
+    for (; off + 4 * AES128_KEYLEN <= len; off += 4 * AES128_KEYLEN) {
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off)), rk[0]);
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 16)), rk[0]);
+        __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 32)), rk[0]);
+        __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off + 48)), rk[0]);
+        for (int r = 1; r < Nr; r++) {
+            b0 = _mm_aesdec_si128(b0, rk[r]);
+            b1 = _mm_aesdec_si128(b1, rk[r]);
+            b2 = _mm_aesdec_si128(b2, rk[r]);
+            b3 = _mm_aesdec_si128(b3, rk[r]);
+        }
+        _mm_storeu_si128((__m128i *)(out + off), _mm_aesdeclast_si128(b0, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 16), _mm_aesdeclast_si128(b1, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 32), _mm_aesdeclast_si128(b2, rk[Nr]));
+        _mm_storeu_si128((__m128i *)(out + off + 48), _mm_aesdeclast_si128(b3, rk[Nr]));
+    }
+    for (; off < len; off += AES128_KEYLEN) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + off)), rk[0]);
+        for (int r = 1; r < Nr; r++)
+            b = _mm_aesdec_si128(b, rk[r]);
+        _mm_storeu_si128((__m128i *)(out + off), _mm_aesdeclast_si128(b, rk[Nr]));
+    }
+}
+
+
+RadioSecurityAESNI::RadioSecurityAESNI(void)
+{
+}
+
+RadioSecurityAESNI::~RadioSecurityAESNI(void)
+{
+}
+
+
+bool
+RadioSecurityAESNI::IsSupported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+
+void *
+RadioSecurityAESNI::CreateEncryptionContext(void *key, int keyLen, void *seed, int seedlen)
+{
+    AESNI_CTX *ctx = new AESNI_CTX;
+    if (!ctx)
+        return NULL;
+
+    uint8_t mykey[AES128_KEYLEN];
+    memset(mykey, 0, sizeof(mykey));
+    memcpy(mykey, key, keyLen  > AES128_KEYLEN ? AES128_KEYLEN : keyLen);
+    /*
+     * The seed is the CBC initial vector in RadioSecurity which
+     * is not used for the ECB message encryption.
+     */
+    (void)seed;
+    (void)seedlen;
+
+    AESNIKeySetup(ctx, mykey);
+
+    return ctx;
+}
+
+
+void
+RadioSecurityAESNI::DestroyEncryptionContext(void *context)
+{
+    delete (AESNI_CTX *)context;
+}
+
+
+int
+RadioSecurityAESNI::GetEncryptionContextSize(void)
+{
+    return sizeof(AESNI_CTX);
+}
+
+
+void *
+RadioSecurityAESNI::InitEncryptionContext(void *memory, void *key, int keyLen)
+{
+    uint8_t mykey[AES128_KEYLEN];
+    
+    memset(mykey, 0, sizeof(mykey));
+    memcpy(mykey, key, keyLen  > AES128_KEYLEN ? AES128_KEYLEN : keyLen);
+    AESNIKeySetup((AESNI_CTX *)memory, mykey);
+    memset(mykey, 0, sizeof(mykey));
+    
+    return memory;
+}
+
+
+void
+RadioSecurityAESNI::EncryptMessage(void *context, const void *input, void *output, int len)
+{
+    AESNIEncrypt(((AESNI_CTX *)context)->encKey, (const uint8_t *)input, (uint8_t *)output, len);
+}
+
+
+void
+RadioSecurityAESNI::DecryptMessage(void *context, const void *input, void *output, int len)
+{
+    AESNIDecrypt(((AESNI_CTX *)context)->decKey, (const uint8_t *)input, (uint8_t *)output, len);
+}
+
+
+bool
+RadioSecurityAESNI::SelfTest(void)
+{
+    uint8_t key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    uint8_t in[]  = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    uint8_t out[] = {0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97};
+    uint8_t buffer[5 * AES128_KEYLEN];
+    uint8_t soft[5 * AES128_KEYLEN];
+    bool ok = true;
+
+    void *context = CreateEncryptionContext(key, sizeof(key));
+    if (!context)
+        return false;
+
+    EncryptMessage(context, in, buffer, sizeof(in));
+    if (memcmp(buffer, out, sizeof(out)) != 0)
+        ok = false;
+    DecryptMessage(context, buffer, buffer, sizeof(out));
+    if (memcmp(buffer, in, sizeof(in)) != 0)
+        ok = false;
+
+    /*
+     * Five blocks cover the four block and the single block path,
+     * the result must match the software implementation.
+     */
+    RadioSecurity sw;
+    void *swcontext = sw.CreateEncryptionContext(key, sizeof(key));
+    for (int i = 0; i < (int)sizeof(buffer); i++)
+        buffer[i] = (uint8_t)(i * 7 + 3);
+    sw.EncryptMessage(swcontext, buffer, soft, sizeof(soft));
+    EncryptMessage(context, buffer, buffer, sizeof(buffer));
+    if (memcmp(buffer, soft, sizeof(soft)) != 0)
+        ok = false;
+    sw.DecryptMessage(swcontext, soft, soft, sizeof(soft));
+    DecryptMessage(context, buffer, buffer, sizeof(buffer));
+    if (memcmp(buffer, soft, sizeof(soft)) != 0)
+        ok = false;
+
+    /*
+     * The authenticated encryption (version 2) runs its counter blocks
+     * through the pipelined EncryptMessage, 80 bytes are six blocks.
+     */
+    uint8_t nonce[12];
+    uint8_t data[80];
+    uint8_t swdata[80];
+    uint8_t tag[4];
+    uint8_t swtag[4];
+    memset(nonce, 0x5a, sizeof(nonce));
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = swdata[i] = (uint8_t)(i * 11 + 1);
+    sw.EncryptAuthMessage(swcontext, nonce, sizeof(nonce), key, sizeof(key), swdata, sizeof(swdata), swtag, sizeof(swtag));
+    EncryptAuthMessage(context, nonce, sizeof(nonce), key, sizeof(key), data, sizeof(data), tag, sizeof(tag));
+    if (memcmp(data, swdata, sizeof(data)) != 0 || memcmp(tag, swtag, sizeof(tag)) != 0)
+        ok = false;
+
+    sw.DestroyEncryptionContext(swcontext);
+    DestroyEncryptionContext(context);
+    return ok;
+}
+
+
+void
+RadioSecurityAESNI::EncryptTest(void)
+{
+    RadioSecurity::EncryptTest(); // includes the AUTH test via AES-NI
+    
+    dprintf("AES-NI ECB/AUTH encrypt/decrypt: ");
+    if (SelfTest()) {
+        dprintf("SUCCESS!");
+    } else {
+        dprintf("FAILURE!");
+    }
+}
+
+
+RadioSecurityInterface *
+RadioSecurityAESNI::Create(void)
+{
+    if (IsSupported()) {
+        RadioSecurityAESNI *sec = new RadioSecurityAESNI();
+        if (sec && sec->SelfTest())
+            return sec;
+        delete sec;
+    }
+    return new RadioSecurity();
+}
+
+#endif // RS_AESNI_AVAILABLE
+
+#endif // FEATURE_LORA
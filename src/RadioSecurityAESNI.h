@@ -0,0 +1,53 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef __RADIOSECURITYAESNI_H__
+#define __RADIOSECURITYAESNI_H__
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RS_AESNI_AVAILABLE	1
+#endif
+
+#ifdef RS_AESNI_AVAILABLE
+
+/*
+ * AES-128 encryption using the x86 AES-NI instructions for gateways.
+ * The ciphertext is identical to RadioSecurity (security version 1),
+ * hashing is inherited from RadioSecurity.
+ */
+class RadioSecurityAESNI : public RadioSecurity {
+public:
+    RadioSecurityAESNI();
+    virtual ~RadioSecurityAESNI();
+
+    virtual void *CreateEncryptionContext(void *key, int keyLen, void *seed = NULL, int seedlen = 0);
+    virtual void DestroyEncryptionContext(void *context);
+    virtual int GetEncryptionContextSize(void);
+    virtual void *InitEncryptionContext(void *memory, void *key, int keyLen);
+    virtual	void EncryptMessage(void *context, const void *input, void *output, int len);
+    virtual void DecryptMessage(void *context, const void *input, void *output, int len);
+    virtual void EncryptTest(void);
+
+    /*
+     * Checks via CPUID if the CPU supports the AES-NI instructions
+     */
+    static bool IsSupported(void);
+    /*
+     * Verifies the AES-NI results against the SP800-38A ECB-AES128 vector
+     * and the ECB and authenticated encryption against the RadioSecurity
+     * software implementation.
+     */
+    bool SelfTest(void);
+    /*
+     * Returns a RadioSecurityAESNI if supported by the CPU and the
+     * self test passes, otherwise the portable RadioSecurity.
+     */
+    static RadioSecurityInterface *Create(void);
+};
+
+#endif // RS_AESNI_AVAILABLE
+
+#endif // __RADIOSECURITYAESNI_H__
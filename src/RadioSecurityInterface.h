@@ -28,6 +28,41 @@ public:
      */
     virtual	void HashPassword(void *seed, int seedLen, void *password, int pwLen, void *hashResult) = 0;
 
+    /*
+     * Compares the hash of the seed and password with a received hash,
+     * returns true if it matches. Implementations should not allocate memory.
+     */
+    virtual bool VerifyPassword(void *seed, int seedLen, void *password, int pwLen, const void *hash) {
+        uint8_t result[64];
+        uint8_t diff = 0;
+        int len = GetHashBlockSize();
+        if (len > (int)sizeof(result))
+            return false;
+        HashPassword(seed, seedLen, password, pwLen, result);
+        for (int i = 0; i < len; i++) // constant time compare
+            diff |= result[i] ^ ((const uint8_t *)hash)[i];
+        return diff == 0;
+    }
+
+    struct VerifyJob {
+        void *seed;
+        int seedLen;
+        void *password;
+        int pwLen;
+        const void *hash;	// received hash
+        bool verified;		// result
+    };
+    
+    /*
+     * Verifies multiple password hashes at once, e.g. for many nodes
+     * connecting after a station restart. Implementations may hash them
+     * in parallel, the default verifies one after the other.
+     */
+    virtual void VerifyPasswordBatch(VerifyJob *jobs, int count) {
+        for (int i = 0; i < count; i++)
+            jobs[i].verified = VerifyPassword(jobs[i].seed, jobs[i].seedLen, jobs[i].password, jobs[i].pwLen, jobs[i].hash);
+    }
+
     /*
      * The encryption/decryption block size in bytes (e.g. 16 bytes for AES128)
      */
@@ -44,16 +79,57 @@ public:
      */
     virtual void DestroyEncryptionContext(void *context) = 0;
     
+    /*
+     * The size of a context for InitEncryptionContext, 0 if only
+     * CreateEncryptionContext is supported.
+     */
+    virtual int GetEncryptionContextSize(void) { return 0; }
+    
+    /*
+     * Initializes a context in caller-provided memory (e.g. a pool) of
+     * GetEncryptionContextSize() bytes and returns the memory,
+     * no DestroyEncryptionContext is needed.
+     */
+    virtual void *InitEncryptionContext(void *memory, void *key, int keyLen) {
+        (void)memory; (void)key; (void)keyLen;
+        return NULL;
+    }
+    
     /*
      *Encrypts a cleartext input message into an encrypted output block
+     * The input and output may be the same buffer (in place encryption).
      */
 	virtual	void EncryptMessage(void *context, const void *input, void *output, int len) = 0;
 
     /*
      * Decrypts an input block into an cleartext output message
+     * The input and output may be the same buffer (in place decryption).
+     * Each block is independent, a message can be decrypted in parts
+     * of multiple block sizes, e.g. the first block before the rest.
      */
 	virtual void DecryptMessage(void *context, const void *input, void *output, int len) = 0;
 
+    /*
+     * Authenticated encryption (security version 2 and later), the data is
+     * encrypted in place without padding and the additional data (e.g. the
+     * RadioHeader) is only authenticated. The nonce must never repeat for a key,
+     * it is zero-padded or truncated to 12 bytes.
+     * Implementations which support it return a version >= 2 in GetSecurityVersion.
+     */
+    virtual bool EncryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, void *tag, int tagLen) {
+        (void)context; (void)nonce; (void)nonceLen; (void)aad; (void)aadLen; (void)data; (void)len; (void)tag; (void)tagLen;
+        return false;
+    }
+
+    /*
+     * Decrypts in place and returns false if the tag does not match,
+     * the data content is undefined in this case.
+     */
+    virtual bool DecryptAuthMessage(void *context, const void *nonce, int nonceLen, const void *aad, int aadLen, void *data, int len, const void *tag, int tagLen) {
+        (void)context; (void)nonce; (void)nonceLen; (void)aad; (void)aadLen; (void)data; (void)len; (void)tag; (void)tagLen;
+        return false;
+    }
+
     virtual void EncryptTest(void) = 0;
 };
 
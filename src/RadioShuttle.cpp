@@ -11,9 +11,6 @@
 /*
  * Known Problems:
  * - For RS_Node_Checking find a receive message solution
- * - Add channel switching support
- * - Add a global AIR busy data table to calculate communication slots
- *	 for available response windows and sends
  * - winScale > 0 should multiply the respWindow value (and not shift)
  * - Add C++ alike callback for RegisterApplication() handler
  */
@@ -34,11 +31,39 @@
 #include "mbed-util.h"
 #endif
 #include "RadioShuttle.h"
+#include "rs_datasum.h"
 
 #ifdef FEATURE_LORA
 
+/*
+ * Orders the RX ring data against the ring index updates
+ * between the radio interrupt and the RunShuttle.
+ */
+#if defined(__ARMCC_VERSION) && (__ARMCC_VERSION < 6000000)
+#define RS_MEMORY_BARRIER()	__schedule_barrier()
+#else
+#define RS_MEMORY_BARRIER()	__sync_synchronize()
+#endif
+
 class RadioEntry;
 
+/*
+ * LoRa modem settings, the frequency and spreading factor are per channel
+ */
+static const int LORA_SYMBOL_TIMEOUT = 5;
+static const int CODING_RATE_4_5 = 1;
+static const int LORA_PREAMBLE_LENGTH = 8;
+static const int LORA_NB_SYMB_HOP = 4;
+
+/*
+ * The SX127x SNR limit in 1/10 dB is -7.5 dB for SF7, each higher
+ * factor allows 2.5 dB less (-20 dB for SF12).
+ */
+static inline int SNRLimit10(int spreadingFactor)
+{
+    return -75 - 25 * (spreadingFactor - 7);
+}
+
 
 static void RDTxDone(void *radio, void *userThisPtr, void *userData)
 {
@@ -93,7 +118,26 @@ const RadioShuttle::RadioProfile RadioShuttle::defaultProfile[] =  {
 };
 
 
-RadioShuttle::RadioShuttle(const char *deviceName)
+const RadioShuttle::PoolProfile RadioShuttle::defaultPoolProfile[] =  {
+    /*
+     * Our default pool sizes per RadioType
+     * send entries, receive entries, airtime entries, connect entries
+     * Nodes with little RAM use the heap, pools are opt-in via SetPoolProfile.
+     */
+    { 0, 0, 0, 0 },		// RS_RadioType_Invalid, uses the heap
+    { 0, 0, 0, 0 },		// RS_Node_Offline
+    { 0, 0, 0, 0 },		// RS_Node_Checking
+    { 0, 0, 0, 0 },		// RS_Node_Online
+    { 32, 8, 32, 32 },		// RS_Station_Basic
+    { 1024, 64, 256, 512 },	// RS_Station_Server
+};
+
+
+RadioShuttle::RadioShuttle(const char *deviceName) :
+    _connections(ConnectMap::key_compare(), ConnectMap::allocator_type(&_connectPool)),
+    _sends(SendMsgList::allocator_type(&_sendPool)),
+    _recvs(ReceivedMsgList::allocator_type(&_recvPool)),
+    _airtimes(TimeOnAirSlotList::allocator_type(&_airtimePool))
 {
     RadioHeader *p;
 
@@ -101,6 +145,7 @@ RadioShuttle::RadioShuttle(const char *deviceName)
     STATIC_ASSERT(sizeof(p->u.fullyv1) == 12, "RadioHeader fullyv1");
     STATIC_ASSERT(sizeof(p->u.packedv1) == 8, "RadioHeader packedv1");
     STATIC_ASSERT(sizeof(EncryptionHeader) == 8, "EncryptionHeader");
+    STATIC_ASSERT(sizeof(AggregateHeader) == 2, "AggregateHeader");
     
     
     busyInShuttle = false;
@@ -109,9 +154,19 @@ RadioShuttle::RadioShuttle(const char *deviceName)
     _maxMTUSize = 0;
     timer = new MyTimeout();
     prevWakeup = 0;
+    _nextWakeup = ~0;
     SetTimerCount = 0;
+    _scheduleSeq = 0;
+    _lastScheduleTime = 0;
+    _poolProfile = defaultPoolProfile;
+    _channelPlan = NULL;
+    _channelPlanCount = 0;
     _statusIntf = NULL;
     _securityIntf = NULL;
+    _compressionIntf = NULL;
+    _verifies = NULL;
+    _verifyCount = 0;
+    _contextSize = 0;
 	ticker = new MyTimer();
 	ticker->start();
 	_startupHandler = (AppStartupHandler)this;
@@ -132,19 +187,47 @@ RadioShuttle::~RadioShuttle()
     list<RadioEntry>::iterator re;
     for(re = _radios.begin(); re != _radios.end(); re++) {
         re->radio->Standby();
+        if (re->rxBuffer)
+            delete[] re->rxBuffer;
+        if (re->txBuffer)
+            delete[] re->txBuffer;
+        if (re->zBuffer)
+            delete[] re->zBuffer;
     }
     
     _radios.clear();
+    if (_verifies)
+        delete[] _verifies;
 
-    list<SendMsgEntry>::iterator me;
+    SendMsgList::iterator me;
     for(me = _sends.begin(); me != _sends.end(); me++) {
         if (me->releaseData)
             delete[] (uint8_t *)me->data;
+        if (me->aggrData)
+            delete[] me->aggrData;
+        if (me->fragData)
+            delete[] me->fragData;
     }
     _sends.clear();
+    _schedule.clear();
+    _inflight.clear();
+    _responses.clear();
     _recvs.clear();
     _airtimes.clear();
     _apps.clear();
+    
+    map<pair<devid_t,int>, ReassemblyEntry>::iterator rit;
+    for(rit = _reassembly.begin(); rit != _reassembly.end(); rit++) {
+        if (rit->second.buffer)
+            delete[] rit->second.buffer;
+    }
+    _reassembly.clear();
+    
+    ConnectMap::iterator cit;
+    for(cit = _connections.begin(); cit != _connections.end(); cit++) {
+        if (cit->second.context)
+            DestroyConnectionContext(cit->second.context);
+    }
     _connections.clear();
     _signals.clear();
 }
@@ -203,6 +286,19 @@ RadioShuttle::AddRadio(Radio *radio, RadioModems_t modem, const struct RadioProf
     if (!_maxMTUSize || _maxMTUSize > radioMTUSize)
         _maxMTUSize = radioMTUSize;
     
+    re.rxBuffer = new uint8_t[RX_RING_SLOTS * radioMTUSize];
+    if (!re.rxBuffer)
+        return RS_OutOfMemory;
+    re.rxBufferSize = radioMTUSize;
+    re.txBuffer = new uint8_t[radioMTUSize];
+    if (!re.txBuffer)
+        return RS_OutOfMemory;
+    re.txBufferSize = radioMTUSize;
+    for (int i = 0; i < RX_RING_SLOTS; i++) {
+        re.rxRing[i].RxData = re.rxBuffer + i * radioMTUSize;
+        re.rxRing[i].re = &re;
+    }
+    
     return RS_NoErr;
 }
 
@@ -229,6 +325,35 @@ RadioShuttle::AddRadioSecurity(RadioSecurityInterface *securityIntf)
 }
 
 
+RSCode
+RadioShuttle::AddRadioCompression(RadioCompressionInterface *compressionIntf)
+{
+    _compressionIntf = compressionIntf;
+    return RS_NoErr;
+}
+
+
+RSCode
+RadioShuttle::SetPoolProfile(const struct PoolProfile *profile)
+{
+    if (!profile)
+        return RS_InvalidParam;
+    _poolProfile = profile;
+    return RS_NoErr;
+}
+
+
+RSCode
+RadioShuttle::SetChannelPlan(const struct ChannelProfile *plan, int count)
+{
+    if (count < 0 || count > MaxDataChannels || (count && !plan))
+        return RS_InvalidParam;
+    _channelPlan = plan;
+    _channelPlanCount = count;
+    return RS_NoErr;
+}
+
+
 RSCode
 RadioShuttle::Startup(RadioType radioType, devid_t myID)
 {
@@ -239,12 +364,46 @@ RadioShuttle::Startup(RadioType radioType, devid_t myID)
         return RS_NoRadioConfigured;
     
     _radioType = radioType;
+    
+    if (radioType >= RS_RadioType_Invalid && radioType <= RS_Station_Server) {
+        const PoolProfile *pp = &_poolProfile[radioType];
+        if (!_sendPool.Reserve(pp->SendEntries, sizeof(SendMsgEntry) + RadioPool::NodeOverhead))
+            return RS_OutOfMemory;
+        if (!_recvPool.Reserve(pp->RecvEntries, sizeof(ReceivedMsgEntry) + RadioPool::NodeOverhead))
+            return RS_OutOfMemory;
+        if (!_airtimePool.Reserve(pp->AirtimeEntries, sizeof(TimeOnAirSlotEntry) + RadioPool::NodeOverhead))
+            return RS_OutOfMemory;
+        if (!_connectPool.Reserve(pp->ConnectEntries, sizeof(ConnectMap::value_type) + RadioPool::NodeOverhead))
+            return RS_OutOfMemory;
+        _contextSize = _securityIntf ? _securityIntf->GetEncryptionContextSize() : 0;
+        if (_contextSize > 0 && !_contextPool.Reserve(pp->ConnectEntries, _contextSize))
+            return RS_OutOfMemory;
+    }
+    if (_securityIntf && radioType >= RS_Station_Basic && !_verifies)
+        _verifies = new ConnectVerifyEntry[MAX_BATCH_VERIFY];
 
     list<RadioEntry>::iterator re;
     for(re = _radios.begin(); re != _radios.end(); re++) {
         _initRadio(&*re);
         dprintf("RandomRetry: %d ms", re->retry_ms);
     }
+    
+    /*
+     * Additional station radios serve the data channels of the plan
+     */
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        re->dataChannel = 0;
+        if (radioType < RS_Station_Basic || re == _radios.begin())
+            continue;
+        for (int i = 0; i < _channelPlanCount; i++) {
+            if (_channelPlan[i].Frequency == re->profile->Frequency &&
+                _channelPlan[i].SpreadingFaktor == re->profile->SpreadingFaktor) {
+                re->dataChannel = i + 1;
+                dprintf("DataChannel: %d (%d Hz)", re->dataChannel, re->profile->Frequency);
+                break;
+            }
+        }
+    }
 
 	if (_startupHandler)
 		_receiveHandler = _startupHandler;
@@ -282,12 +441,9 @@ RadioShuttle::UpdateNodeStartup(RadioType newRadioType)
 RSCode
 RadioShuttle::_initRadio(RadioEntry *re)
 {
-    int LORA_SYMBOL_TIMEOUT = 5;
-    int CODING_RATE_4_5 = 1;
-    int LORA_PREAMBLE_LENGTH = 8;
-    int LORA_NB_SYMB_HOP = 4;
-    
     re->radio->SetChannel(re->profile->Frequency + re->profile->FrequencyOffset);
+    re->channel = 0;
+    re->factor = 0;
     if (_statusIntf)
         _statusIntf->SetRadioParams(re->profile->Frequency, re->profile->SpreadingFaktor);
 
@@ -394,15 +550,26 @@ RadioShuttle::DeRegisterApplication(int AppID)
         return RS_AppID_NotFound;
     }
  
-    list<SendMsgEntry>::iterator me;
+    SendMsgList::iterator me;
     me = _sends.begin();
     while(me != _sends.end()) { // while loop to overcome erase list problem
-        if (AppID == me->AppID) {
-            if (me->releaseData)
-                delete[] (uint8_t *)me->data;
-            me = _sends.erase(me); // erase() returns the next list entry
-        } else
-            me++;
+        SendMsgList::iterator next = me;
+        next++;
+        if (AppID == me->AppID)
+            RemoveMsg(me); // frames contain only messages of the same app
+        me = next;
+    }
+    
+    map<pair<devid_t,int>, ReassemblyEntry>::iterator rit = _reassembly.begin();
+    while(rit != _reassembly.end()) {
+        map<pair<devid_t,int>, ReassemblyEntry>::iterator next = rit;
+        next++;
+        if (AppID == rit->first.second) {
+            if (rit->second.buffer)
+                delete[] rit->second.buffer;
+            _reassembly.erase(rit);
+        }
+        rit = next;
     }
 
     _apps.erase(it);
@@ -424,6 +591,50 @@ RadioShuttle::AppRequiresAuthentication(int AppID)
 }
 
 
+RSCode
+RadioShuttle::EnableAggregation(int AppID, bool enable)
+{
+    map<int, AppEntry>::iterator it = _apps.find(AppID);
+    if(it == _apps.end()) {
+        return RS_AppID_NotFound;
+    }
+    if (enable && it->second.fragmentSize)
+        return RS_InvalidParam;
+    it->second.aggregate = enable;
+    return RS_NoErr;
+}
+
+
+RSCode
+RadioShuttle::EnableFragmentation(int AppID, int maxMsgSize)
+{
+    map<int, AppEntry>::iterator it = _apps.find(AppID);
+    if(it == _apps.end()) {
+        return RS_AppID_NotFound;
+    }
+    if (maxMsgSize < 0 || maxMsgSize > MaxFragmentedSize)
+        return RS_InvalidParam;
+    if (maxMsgSize && it->second.aggregate)
+        return RS_InvalidParam;
+    it->second.fragmentSize = maxMsgSize;
+    return RS_NoErr;
+}
+
+
+RSCode
+RadioShuttle::EnableCompression(int AppID, bool enable)
+{
+    map<int, AppEntry>::iterator it = _apps.find(AppID);
+    if(it == _apps.end()) {
+        return RS_AppID_NotFound;
+    }
+    if (enable && !_compressionIntf)
+        return RS_NoCompressionInterface;
+    it->second.compress = enable;
+    return RS_NoErr;
+}
+
+
 RSCode
 RadioShuttle::Connect(int AppID, devid_t stationID)
 {
@@ -439,7 +650,7 @@ RadioShuttle::Connect(int AppID, devid_t stationID)
     if(!_securityIntf)
         return RS_NoSecurityInterface;
     
-    map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(stationID, AppID));
+    ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(stationID, AppID));
    
     if (cit != _connections.end()) {
         return RS_DuplicateAppID;
@@ -451,9 +662,11 @@ RadioShuttle::Connect(int AppID, devid_t stationID)
     r.AppID = AppID;
     r.authorized = false;
 
+    if (_connectPool.Exhausted() || _sendPool.Exhausted())
+        return RS_OutOfMemory;
     _connections.insert(std::make_pair(pair<devid_t, int>(stationID, AppID), r));
 
-    SendMsg(AppID, NULL, _securityIntf->GetHashBlockSize(), MF_Connect|MF_NeedsConfirm, stationID);
+    SendMsg(AppID, NULL, ConnectMsgSize(), MF_Connect|MF_NeedsConfirm, stationID);
     
     return RS_NoErr;
 }
@@ -466,9 +679,6 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
     ConnectEntry *cop = NULL;
     
     
-    if (len > _maxMTUSize - (int)sizeof(RadioHeader))
-        return RS_MessageSizeExceeded;
-    
     map<int, AppEntry>::iterator it = _apps.find(AppID);
     
     if(it == _apps.end()) {
@@ -476,8 +686,12 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
     }
     aep = &it->second;
     
+    bool fragment = aep->fragmentSize && !(flags & MF_Connect);
+    if (fragment && len > aep->fragmentSize)
+        return RS_MessageSizeExceeded;
+    
     if (!(flags & MF_Direct) && aep->password && !(flags & MF_Connect)) {
-        map<pair<devid_t,int>, ConnectEntry>::iterator ce = _connections.find(pair<devid_t,int>(stationID, AppID));
+        ConnectMap::iterator ce = _connections.find(pair<devid_t,int>(stationID, AppID));
         
         if (ce == _connections.end()) {
             return RS_StationNotConnected;
@@ -489,7 +703,7 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
         if (ce->second.authorized == false) {
             bool connectPending = false;
             
-            list<SendMsgEntry>::iterator me;
+            SendMsgList::iterator me;
             for(me = _sends.begin(); me != _sends.end(); me++) {
                 if (AppID == me->AppID && me->flags & MF_Connect && me->stationID == stationID) {
                     connectPending = true;
@@ -497,14 +711,43 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
                 }
             }
             if (!connectPending) { // try to connect again.
-                SendMsg(AppID, NULL, _securityIntf->GetHashBlockSize(), MF_Connect|MF_NeedsConfirm, stationID);
+                SendMsg(AppID, NULL, ConnectMsgSize(), MF_Connect|MF_NeedsConfirm, stationID);
             }
         }
     }
     
+    /*
+     * Encrypted messages fit into the frame of the connection's
+     * security version, version 1 until it is known.
+     */
+    if (!fragment) {
+        int maxLen = (flags & MF_Connect) ? _maxMTUSize - (int)sizeof(RadioHeader) : MaxFrameSize(aep, flags, cop);
+        if (aep->aggregate)
+            maxLen -= sizeof(AggregateHeader);
+        if (len > maxLen)
+            return RS_MessageSizeExceeded;
+    }
+    
+    if (_sendPool.Exhausted())
+        return RS_OutOfMemory;
+    
     struct SendMsgEntry r;
     memset(&r, 0, sizeof(r));
     r.AppID = AppID;
+    if (fragment) {
+        /*
+         * All messages of the app carry a FragmentHeader, the receiver
+         * reports missing fragments with the confirmation.
+         */
+        r.fragSize = MaxFrameSize(aep, flags, cop) - (int)sizeof(FragmentHeader);
+        if (r.fragSize <= 0)
+            return RS_NoRadioConfigured;
+        int fragCount = (len + r.fragSize - 1) / r.fragSize;
+        if (fragCount > MaxFragments)
+            return RS_MessageSizeExceeded;
+        r.fragCount = fragCount ? fragCount : 1;
+        flags |= MF_NeedsConfirm;
+    }
     if (flags & CF_CopyData) {
         uint8_t *newdata = new uint8_t[len];
         if (!newdata)
@@ -531,6 +774,7 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
     	r.pStatus = PS_Queued;
 
     _sends.push_back(r);
+    ScheduleMsg(--_sends.end());
     RunShuttle();
     return RS_NoErr;
 }
@@ -539,12 +783,10 @@ RadioShuttle::SendMsg(int AppID, void *data, int len, int flags, devid_t station
 RSCode
 RadioShuttle::KillMsg(int AppID, int msgID)
 {
-    list<SendMsgEntry>::iterator me;
+    SendMsgList::iterator me;
     for(me = _sends.begin(); me != _sends.end(); me++) {
         if (AppID == me->AppID && msgID == me->msgID) {
-            if (me->releaseData)
-                delete[] (uint8_t *)me->data;
-            _sends.erase(me);
+            RemoveMsg(me);
             return RS_NoErr;
         }
     }
@@ -583,19 +825,28 @@ RadioShuttle::UpdateRadioProfile(Radio *radio, RadioType radioType, const struct
 
 
 RSCode
-RadioShuttle::MaxMessageSize(int *size, int msgFlags)
+RadioShuttle::MaxMessageSize(int *size, int msgFlags, int AppID, devid_t stationID)
 {
     if (_radios.size() < 1) {
         return RS_NoRadioConfigured;
     }
     
-    int overhead = sizeof(RadioHeader);
-    if (msgFlags & MF_Encrypted) {
-        if (_securityIntf)
-        	overhead += _securityIntf->GetEncryptionBlockSize();
+    int maxSize = _maxMTUSize - sizeof(RadioHeader);
+    if (msgFlags & MF_Encrypted && _securityIntf) {
+        bool v2 = false;
+        if (stationID != DEV_ID_ANY) {
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(stationID, AppID));
+            v2 = cit != _connections.end() && cit->second.secVersion >= SecurityVersion_v2;
+        }
+        if (v2) {
+            maxSize -= SecuritySeqSize_v2 + SecurityTagSize_v2;
+        } else {
+            int bsize = _securityIntf->GetEncryptionBlockSize();
+            maxSize = (maxSize / bsize) * bsize - sizeof(EncryptionHeader);
+        }
     }
 	if (size)
-        *size = _maxMTUSize - overhead;
+        *size = maxSize;
 
 	return RS_NoErr;
 }
@@ -676,6 +927,8 @@ RadioShuttle::StrError(RSErrorCode err)
             return "InvalidParam";
         case RS_OutOfMemory:
             return "OutOfMemory";
+        case RS_NoCompressionInterface:
+            return "NoCompressionInterface";
     }
     return "Unkown";
 }
@@ -727,21 +980,22 @@ RadioShuttle::RunShuttle(void)
             if (_statusIntf)
                 _statusIntf->TXComplete();
         }
-        if (re->rxMsg.RxData) {
-            struct ReceivedMsgEntry r;
-    	    memset(&r, 0, sizeof(r));
-        	r.RxData = (void *)re->rxMsg.RxData;
-        	r.RxSize = re->rxMsg.RxSize;
-        	r.rssi = re->rxMsg.rssi;
-        	r.snr = re->rxMsg.snr;
-            r.re = &*re;
-            
-            _recvs.push_back(r);
-
-            re->rxMsg.RxData = NULL;
+        /*
+         * The ring slots stay in use until the _recvs are processed
+         */
+        uint8_t rxHead = re->rxHead;
+        RS_MEMORY_BARRIER(); // slot data up to rxHead is complete
+        for (uint8_t slot = re->rxTail; slot != rxHead; slot = (slot + 1) & (RX_RING_SLOTS-1)) {
+            ReceivedMsgEntry *rx = &re->rxRing[slot];
+            if (_recvPool.Exhausted()) {
+                re->rStats.noMemoryError++;
+                continue; // drop it, no space to process the packet
+            }
+            _recvs.push_back(*rx);
             if (_statusIntf)
-                _statusIntf->RxDone(re->rxMsg.RxSize, re->rxMsg.rssi, re->rxMsg.snr);
+                _statusIntf->RxDone(rx->RxSize, rx->rssi, rx->snr);
         }
+        re->rxPending = rxHead;
     }
     
     /*
@@ -753,21 +1007,45 @@ RadioShuttle::RunShuttle(void)
     	if (_statusIntf && !_recvs.size())
         	_statusIntf->RxCompleted();
     }
+    RS_MEMORY_BARRIER(); // we are done with the slot data
+    for(re = _radios.begin(); re != _radios.end(); re++)
+        re->rxTail = re->rxPending; // release the slots to the interrupt
+    
+    if (_verifyCount)
+        BatchVerifyConnects(false);
 
     /*
      * Start sending all pending messages on all radio interfaces
+     * The _schedule is ordered by the next due time of the messages,
+     * only messages which are due will be visited. Queued and completed
+     * messages are due immediately (dueTime 0).
      * Note that the timer may overflow with larger numbers
      * at the end of the 32-bit counter and start over again.
      * In this case we skip the request and expect that a retry works.
      */
-    uint32_t sendBusyDelay = 0;
+    uint32_t txGuardEnd = ~0;	// Nearest end of a TX guard time which blocked a send
     uint32_t tstamp = ticker->read_ms();
-    list<SendMsgEntry>::iterator me;
-    for(me = _sends.begin(); me != _sends.end(); me++) {
-        if (me->lastSentTime > tstamp) { // This checks for timer overflow
-            me->lastSentTime = tstamp;
-            me->pStatus = PS_SendRequestCompleted; // Abort request on overflow
+    SendMsgList::iterator me;
+    if (tstamp < _lastScheduleTime) { // timer overflow, all due times are invalid
+        for(me = _sends.begin(); me != _sends.end(); me++) {
+            if (me->lastSentTime > tstamp) {
+                me->lastSentTime = tstamp;
+                me->pStatus = PS_SendRequestCompleted; // Abort request on overflow
+            }
+            RescheduleMsg(&*me);
         }
+        _airtimes.clear();
+        list<RadioEntry>::iterator re;
+        for(re = _radios.begin(); re != _radios.end(); re++)
+            re->channelBusyUntil = 0;
+    }
+    _lastScheduleTime = tstamp;
+    
+    map<pair<uint32_t,uint32_t>, SendMsgList::iterator>::iterator sit = _schedule.begin();
+    while(sit != _schedule.end() && sit->first.first <= tstamp) {
+        pair<uint32_t,uint32_t> due = sit->first;
+        me = sit->second;
+        sit++; // the current entry gets rescheduled or removed below
         
         /*
          * Check if we have something ready for sending, otherwise 
@@ -784,23 +1062,31 @@ RadioShuttle::RunShuttle(void)
                  */
                 if (me->retryCount >= MAX_SENT_RETRIES && me->lastSentTime &&
                     tstamp > me->lastSentTime + me->lastTimeOnAir + me->confirmTimeout) {
-                    me->pStatus = PS_SendTimeout;
-                    continue; // Timeout and no confirmation
+                    me->pStatus = PS_SendTimeout; // Timeout and no confirmation
                 } else if (!(tstamp > me->lastSentTime + me->lastTimeOnAir + me->retry_ms)) {
+                    RescheduleMsg(&*me);
                     continue; // Still waiting for retry time
                 }
                 break;
             case PS_GotSendSlot:
                 if (tstamp < me->responseTime) {
+                    RescheduleMsg(&*me);
                     continue; // Not ready for sending data
                 }
                 break;
-            case PS_SendRequestCompleted:
-                continue;
-            case PS_SendRequestConfirmed:
-                continue;
             default:
-                continue;
+                break;
+        }
+        
+        /*
+         * For completed or timed-out packets we call the registered
+         * callbacks and remove the packets from the queue.
+         */
+        if (me->pStatus >= PS_SendRequestCompleted) {
+            CompleteMsg(me);
+            // the app handler may have removed other messages (KillMsg)
+            sit = _schedule.upper_bound(due);
+            continue;
         }
         
         /*
@@ -808,6 +1094,9 @@ RadioShuttle::RunShuttle(void)
          */
         list<RadioEntry>::iterator re;
         for(re = _radios.begin(); re != _radios.end(); re++) {
+            if (re->dataChannel != me->radioChannel)
+                continue; // Station radios send on their own channel only
+            
             /*
              * Sending packets without a delay has a problem that we cannot detect
              * answers on previous requests which results into collisions.
@@ -816,9 +1105,9 @@ RadioShuttle::RunShuttle(void)
             if (tstamp < re->lastTxDone) // overflow
             	re->lastTxDone = 0;
             if (re->lastTxDone && tstamp <= re->lastTxDone + (re->timeOnAir12Bytes/5)) {
-                int wait_ms = (re->lastTxDone + (re->timeOnAir12Bytes/5)) - tstamp;
-                if ((int)sendBusyDelay > wait_ms)
-                    sendBusyDelay = wait_ms;
+                uint32_t guardEnd = re->lastTxDone + (re->timeOnAir12Bytes/5) + 1;
+                if (guardEnd < txGuardEnd)
+                    txGuardEnd = guardEnd;
             	continue;
             }
 			
@@ -827,20 +1116,39 @@ RadioShuttle::RunShuttle(void)
 			 * this avoids overloading the server with messages.
 			 * this allows than an ongoing Connect will be completed first
 			 */
-			bool skip = false;
 			if (me->pStatus == PS_Queued) {
-    			list<SendMsgEntry>::iterator tme;
-    			for(tme = _sends.begin(); tme != _sends.end(); tme++) {
-					if (tme == me) // skip my
-						continue;
-					if (tme->AppID == me->AppID && tme->stationID == me->stationID && tme->pStatus > PS_Queued) {
-						skip = true;
-						break;
-					}
-				}
+				if (_inflight.find(pair<int,devid_t>(me->AppID, me->stationID)) != _inflight.end())
+					continue;
 			}
-			if (skip)
-				continue;
+			
+            /*
+             * The first send of an aggregating app builds the frame,
+             * the following queued messages are taken along.
+             */
+            if (!me->aggrData && !me->retryCount && me->aep && me->aep->aggregate &&
+                !(me->flags & (MF_Response|MF_Connect))) {
+                if (!AggregateMsgs(&*me)) {
+                    re->rStats.noMemoryError++;
+                    continue;
+                }
+                // the next _schedule entry may have been taken along
+                sit = _schedule.upper_bound(pair<uint32_t,uint32_t>(me->dueTime, me->dueSeq));
+            }
+			
+            /*
+             * Do not overlap the overheard send slots of other stations,
+             * our own send slot has been planned by the station.
+             */
+            if (me->pStatus != PS_GotSendSlot && !_airtimes.empty()) {
+                int txLen = sizeof(RadioHeader) + ((me->flags & MF_Response) ? me->len : 0);
+                uint32_t reservedEnd = AirtimeReserved(&*re, tstamp, re->radio->TimeOnAir(re->modem, txLen));
+                if (reservedEnd) {
+                    re->rStats.airtimeDeferCount++;
+                    if (reservedEnd + 1 < txGuardEnd)
+                        txGuardEnd = reservedEnd + 1;
+                    continue;
+                }
+            }
 		
             /*
         	 * Check that the radio is not busy, no signal on air
@@ -849,6 +1157,27 @@ RadioShuttle::RunShuttle(void)
             if (rState == RF_TX_RUNNING) {
             	continue;
             }
+            
+            /*
+             * Nodes send the data of a slot granted on another channel there
+             * and wait for the confirmation, meanwhile other sends wait.
+             * A retry requests a new slot on the control channel.
+             */
+            if (re->channelMsg && re->channelMsg != &*me)
+                continue;
+            if (!re->channelMsg && me->pStatus == PS_GotSendSlot && (me->channel || me->factor)) {
+                if (rState == RF_RX_RUNNING && re->radio->RxSignalPending()) {
+                    re->rStats.channelBusyCount++;
+                    continue;
+                }
+                if (SwitchChannel(&*re, me->channel, me->factor))
+                    re->channelMsg = &*me;
+                rState = re->radio->GetStatus();
+            } else if (re->channelMsg && me->pStatus != PS_GotSendSlot) {
+                SwitchChannel(&*re, 0, 0);
+                re->channelMsg = NULL;
+                rState = re->radio->GetStatus();
+            }
             if (rState == RF_RX_RUNNING) {
                 if (re->radio->RxSignalPending()) {
                     re->rStats.channelBusyCount++;
@@ -856,21 +1185,21 @@ RadioShuttle::RunShuttle(void)
                     continue;
                 }
             } else {
-            	if (CadDetection(&*re))
-            		continue;
+            	if (CadDetection(&*re, tstamp))
+            		continue; // Busy or CAD still running, RS_CadDone calls us again
             }
             /*
              * Finally send the message.
              */
             int msgFlags = 0;
             void *data = NULL;
-            int len = me->len;
+            int len = me->aggrData ? me->aggrLen : me->len;
             
             if (me->pStatus == PS_Queued || me->pStatus == PS_Sent || me->pStatus == PS_WaitForConfirm) {
                 if (me->flags & MF_Response) {
                     msgFlags = me->flags; // Response header
-                    if (me->flags & MF_Connect)
-                        data = me->data;
+                    if (me->flags & MF_Connect || me->len > 0)
+                        data = me->data; // e.g. randoms, our version or the missing fragments
                 } else {
                     msgFlags = me->flags & (MF_LowPriority|MF_HighPriority|MF_Connect); // Request slot state
                     if (_radioType >= RS_Station_Basic && me->pStatus != PS_GotSendSlot)
@@ -879,9 +1208,27 @@ RadioShuttle::RunShuttle(void)
             }
             if (me->pStatus == PS_GotSendSlot) {
                 msgFlags = me->flags & (MF_LowPriority|MF_HighPriority|MF_NeedsConfirm|MF_Connect|MF_Encrypted); // send data
-                data = me->data;
+                data = me->aggrData ? me->aggrData : me->data;
+                if (me->fragCount) {
+                    /*
+                     * The unconfirmed fragments are sent as a burst, the last
+                     * one of the burst asks for the confirmation.
+                     */
+                    int index = NextFragment(&*me, me->fragNext);
+                    len = index < 0 ? -1 : BuildFragment(&*me, index);
+                    if (len < 0) {
+                        re->rStats.noMemoryError++;
+                        continue;
+                    }
+                    data = me->fragData;
+                    me->fragNext = index + 1;
+                    if (NextFragment(&*me, me->fragNext) >= 0)
+                        msgFlags &= ~MF_NeedsConfirm;
+                }
             }
             SendMessage(&*re, data, len, me->msgID, me->AppID,  me->stationID, msgFlags, me->txPower, me->respWindow, me->channel, me->factor);
+            if (me->pStatus == PS_GotSendSlot && me->fragCount && NextFragment(&*me, me->fragNext) >= 0)
+                break; // the next fragment follows after TX done
             
             me->retryCount++;
 			me->lastSentTime = tstamp;
@@ -898,46 +1245,12 @@ RadioShuttle::RunShuttle(void)
             	me->responseTime = 0;
             }
         }
-    }
-    
-    /*
-     * For completed or timed-out packets from the queue
-     * we call the registered callbacks.
-     * Remove completed packets from queue.
-     */
-    me = _sends.begin();
-    while(me != _sends.end()) { // while loop to overcome erase list problem
-        bool shouldDelete = false;
-        if (me->pStatus == PS_SendRequestCompleted || me->pStatus == PS_SendRequestConfirmed ||
-            me->pStatus == PS_SendTimeout) {
-            
-            map<int, AppEntry>::iterator it = _apps.find(me->AppID);
-            if(it != _apps.end()) {
-                int status = MS_SentCompleted;
-                if (me->pStatus == PS_SendTimeout)
-                    status = MS_SentTimeout;
-                else if (me->pStatus == PS_SendRequestCompleted)
-                    status = MS_SentCompleted;
-                else if (me->pStatus == PS_SendRequestConfirmed)
-                    status = MS_SentCompletedConfirmed;
-                
-                if (me->flags != MF_Response) {
-                    if (me->pStatus == PS_SendTimeout) {
-                        DeleteSignalStrength(me->stationID);
-                        if (_statusIntf)
-                            _statusIntf->MessageTimeout(me->AppID, me->stationID);
-                    }
-                    it->second.handler(me->AppID, me->stationID, me->msgID, status, me->data, me->len);
-                }
-            }
-            shouldDelete = true;
-        }
-        if (shouldDelete) {
-            if (me->releaseData)
-                delete[] (uint8_t *)me->data;
-            me = _sends.erase(me); // erase() returns the next list entry
-        } else
-        	me++;
+        
+        if (me->pStatus >= PS_SendRequestCompleted)
+            CompleteMsg(me);
+        else
+            RescheduleMsg(&*me);
+        sit = _schedule.upper_bound(due); // see above
     }
     
     /*
@@ -947,25 +1260,8 @@ RadioShuttle::RunShuttle(void)
      * Additional interrupts (e.g. TX Done, other timers,  etc.) will not
      * hurt because we verify that the time is due for a retry or sending.
      */
-    uint32_t responseTimeMin = ~0;
-    uint32_t lastSentTimeMin = ~0;
+    uint32_t time_abs = PlanWakeup(txGuardEnd);
     tstamp = ticker->read_ms();
-
-    for(me = _sends.begin(); me != _sends.end(); me++) {
-        
-        if (me->responseTime && me->responseTime < responseTimeMin) {
-            responseTimeMin = me->responseTime;
-            // dprintf("responseTimeMin: %d", (int)responseTimeMin);
-        }
-        
-        if (me->lastSentTime && me->lastSentTime + me->lastTimeOnAir + me->retry_ms < lastSentTimeMin) {
-            lastSentTimeMin = me->lastSentTime + me->lastTimeOnAir + me->retry_ms;
-        }
-        if (sendBusyDelay && sendBusyDelay < lastSentTimeMin)
-            lastSentTimeMin = sendBusyDelay;
-    }
-        
-    uint32_t time_abs = std::min(responseTimeMin, lastSentTimeMin);
     
     if (time_abs != (uint32_t)~0) {
         uint32_t wakeup;
@@ -1025,8 +1321,8 @@ RadioShuttle::RunShuttle(void)
 void
 RadioShuttle::ProcessReceivedMessages()
 {
-    static int prevLen = 0;
-    list<ReceivedMsgEntry>::iterator rme;
+    ReceivedMsgList::iterator rme;
+    
     rme = _recvs.begin();
     while(rme != _recvs.end()) { // while loop to overcome erase list problem
         map<int, AppEntry>::iterator it;
@@ -1045,12 +1341,6 @@ RadioShuttle::ProcessReceivedMessages()
         }
  		rme->re->rStats.lastRXdeviceID = source;
 		
-        if (destination !=  DEV_ID_ANY && destination != _deviceID && msgFlags & MF_Response) {
-            int timeOnAir = rme->re->radio->TimeOnAir(rme->re->modem, prevLen);
-            
-        	SaveTimeOnAirSlot(destination, AppID, msgFlags, respWindow, channel, factor, timeOnAir);
-        }
-        prevLen = len;
         /*
          * Check if we support the AppID
          */
@@ -1067,7 +1357,7 @@ RadioShuttle::ProcessReceivedMessages()
         }
 
         if (aep->password && !(msgFlags & MF_Connect)) {
-            map<pair<devid_t,int>, ConnectEntry>::iterator ce;
+            ConnectMap::iterator ce;
 #if 0
             for(ce = _connections.begin(); ce != _connections.end(); ce++) {
                 dprintf("station: %d, app: %d, authorized: %d, random: 0x%x-%x",
@@ -1100,8 +1390,8 @@ RadioShuttle::ProcessReceivedMessages()
                  * The station has been restartet, connect again.
                  */
                 if (_securityIntf) {
-                	ce->second.authorized = false;
-                	SendMsg(AppID, NULL, _securityIntf->GetHashBlockSize(), MF_Connect|MF_NeedsConfirm, source);
+                	AuthorizeConnection(&ce->second, aep, false, _deviceID);
+                	SendMsg(AppID, NULL, ConnectMsgSize(), MF_Connect|MF_NeedsConfirm, source);
                 }
                 goto ProcessingDone;
             }
@@ -1111,14 +1401,7 @@ RadioShuttle::ProcessReceivedMessages()
          * Check if the response is expected
          */
         if (msgFlags & MF_Response) {
-            SendMsgEntry *mep = NULL;
-            list<SendMsgEntry>::iterator me;
-            for(me = _sends.begin(); me != _sends.end(); me++) {
-                if (msgID == (me->msgID & msgIDv1Mask)) {
-                    mep = &*me;
-                    break;
-                }
-            }
+            SendMsgEntry *mep = FindResponseMsg(source, AppID, msgID);
         	if (!mep) {
                 rme->re->rStats.unkownMessageCount++;
                 goto ProcessingDone;
@@ -1135,6 +1418,120 @@ ProcessingDone:
 }
 
 
+void
+RadioShuttle::BatchVerifyConnects(bool force)
+{
+    if (!_verifyCount)
+        return;
+    
+    if (!force && _verifyCount < MAX_BATCH_VERIFY && ticker->read_ms() - _verifies[0].received < (uint32_t)BATCH_VERIFY_MS) {
+        list<RadioEntry>::iterator re;
+        for(re = _radios.begin(); re != _radios.end(); re++) {
+            if (re->radio->RxSignalPending())
+                return; // more Connects may follow
+        }
+    }
+    
+    RadioSecurityInterface::VerifyJob jobs[MAX_BATCH_VERIFY];
+    int count = _verifyCount;
+    for (int i = 0; i < count; i++) {
+        ConnectVerifyEntry *vep = &_verifies[i];
+        map<int, AppEntry>::iterator it = _apps.find(vep->AppID);
+        RadioSecurityInterface::VerifyJob &j(jobs[i]);
+        j.seed = vep->random;
+        j.seedLen = sizeof(vep->random);
+        j.password = it != _apps.end() ? it->second.password : NULL;
+        j.pwLen = it != _apps.end() ? it->second.pwLen : 0;
+        j.hash = vep->data;
+        j.verified = false;
+    }
+    _verifyCount = 0;
+    
+    _securityIntf->VerifyPasswordBatch(jobs, count);
+    for (int i = 0; i < count; i++)
+        ConnectVerified(&_verifies[i], jobs[i].verified);
+}
+
+
+void
+RadioShuttle::ConnectVerified(ConnectVerifyEntry *vep, bool verified)
+{
+    map<int, AppEntry>::iterator it = _apps.find(vep->AppID);
+    if (it == _apps.end())
+        return; // deregistered meanwhile
+    AppEntry *aep = &it->second;
+    
+    ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(vep->source, vep->AppID));
+    if (cit == _connections.end() || cit->second.random[0] != vep->random[0] || cit->second.random[1] != vep->random[1])
+        return; // a newer Connect is in progress
+    
+    int addFlags;
+    uint8_t confirmVersion = 0;	// Our offered or the negotiated security version
+    int shaLen = _securityIntf->GetHashBlockSize();
+    if (verified) {
+        if (_wireDumpSettings.recvs)
+            dprintf("Password: Ok");
+        addFlags = MF_Connect;
+        cit->second.secVersion = SecurityVersion_v1;
+        memset(cit->second.nodeRandom, 0, sizeof(cit->second.nodeRandom));
+        if (vep->len > shaLen) {
+            cit->second.secVersion = min(vep->data[shaLen], (uint8_t)_securityIntf->GetSecurityVersion());
+            memcpy(cit->second.nodeRandom, vep->data + shaLen + 1, sizeof(cit->second.nodeRandom));
+            confirmVersion = cit->second.secVersion;
+        } else if (_securityIntf->GetSecurityVersion() >= SecurityVersion_v2) {
+            confirmVersion = _securityIntf->GetSecurityVersion(); // version 1 nodes ignore it
+        }
+        AuthorizeConnection(&cit->second, aep, true, vep->source);
+    } else {
+        if (_wireDumpSettings.recvs)
+            dprintf("Password: Failed");
+        addFlags = MF_Connect|MF_Authentication;
+    }
+    if (!(addFlags & MF_Authentication) && cit->second.authorized) {
+        aep->handler(aep->AppID, vep->source, vep->msgID, MS_StationConnected, vep->data, vep->len);
+    }
+    if (addFlags & MF_Authentication) {
+        aep->handler(aep->AppID, vep->source, vep->msgID, MS_AuthenicationRequired, vep->data, vep->len);
+    }
+    if (vep->msgFlags & MF_NeedsConfirm)
+        QueueConfirm(vep->re, aep, vep->source, vep->msgID, MF_Response|addFlags, &confirmVersion, confirmVersion ? sizeof(confirmVersion) : 0);
+}
+
+
+void
+RadioShuttle::QueueConfirm(RadioEntry *re, AppEntry *aep, devid_t source, int msgID, int flags, const void *data, int len)
+{
+    struct SendMsgEntry r;
+    if (_sendPool.Exhausted() || len > (int)sizeof(r.securityData)) {
+        re->rStats.noMemoryError++;
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.AppID = aep->AppID;
+    r.data = NULL;
+    r.len = 0;
+    r.flags = flags;
+    r.stationID = source;
+    r.txPower = TX_POWER_AUTO;
+    r.msgID = msgID;
+    r.cep = NULL;
+    r.aep = aep;
+    r.respWindow = 0;
+    r.radioChannel = re->dataChannel;
+    r.pStatus = PS_Queued;
+    r.retryCount = MAX_SENT_RETRIES-1; // Only one immediate try
+    
+    _sends.push_back(r);
+    if (len > 0) { // e.g. our security version or the missing fragments
+        SendMsgEntry &cr(_sends.back());
+        memcpy(cr.securityData, data, len);
+        cr.data = cr.securityData;
+        cr.len = len;
+    }
+    ScheduleMsg(--_sends.end());
+}
+
+
 bool
 RadioShuttle::ProcessResponseMessage(ReceivedMsgEntry *rme, AppEntry *aep, SendMsgEntry *mep, int msgFlags, void *data, int len, devid_t source, uint32_t respWindow, uint8_t channel, uint8_t factor)
 {
@@ -1144,40 +1541,101 @@ RadioShuttle::ProcessResponseMessage(ReceivedMsgEntry *rme, AppEntry *aep, SendM
     if (!(mep->pStatus == PS_Sent || mep->pStatus == PS_WaitForConfirm))
         return false;
 
+    UpdateTXPower(rme->re, source, true); // our request or data arrived
+    
     if (mep->pStatus == PS_WaitForConfirm) { // Ok, this is the confirmation
+        if (mep->fragCount > 1 && data && len == sizeof(uint32_t)) {
+            uint32_t missing;
+            memcpy(&missing, data, sizeof(missing));
+            if (missing) { // send the missing fragments again
+                mep->fragAcked |= ~missing;
+                mep->fragNext = 0;
+                mep->pStatus = PS_GotSendSlot;
+                mep->responseTime = ticker->read_ms();
+                RescheduleMsg(mep);
+                return true;
+            }
+        }
         mep->pStatus = PS_SendRequestConfirmed;
+        RescheduleMsg(mep);
+        if (rme->re->channelMsg == mep) { // back to the control channel
+            SwitchChannel(rme->re, 0, 0);
+            rme->re->channelMsg = NULL;
+        }
         if (msgFlags & MF_Connect && !(msgFlags & MF_Authentication)) {
-            map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
             if (cit == _connections.end())
                 return false;
-            cit->second.authorized = true;
             cit->second.random[0] = mep->tmpRandom[0];
             cit->second.random[1] = mep->tmpRandom[1];
+            cit->second.rxSeq = 0;
+            cit->second.secVersion = SecurityVersion_v1;
+            bool upgrade = false;
+            if (data && len > 0 && _securityIntf) {
+                uint8_t version = *(uint8_t *)data;
+                uint8_t ourVersion = _securityIntf->GetSecurityVersion();
+                if (mep->len > _securityIntf->GetHashBlockSize()) { // the station confirmed our version
+                    cit->second.secVersion = min(version, ourVersion);
+                } else if (version >= SecurityVersion_v2 && ourVersion >= SecurityVersion_v2) {
+                    // offered by the station, a new Connect negotiates it
+                    upgrade = cit->second.peerVersion < SecurityVersion_v2;
+                    cit->second.peerVersion = version;
+                }
+            }
+            AuthorizeConnection(&cit->second, aep, true, _deviceID);
+            if (upgrade)
+                SendMsg(aep->AppID, NULL, ConnectMsgSize(), MF_Connect|MF_NeedsConfirm, source);
         }
         return true;
     }
 
     mep->pStatus = PS_GotSendSlot;
-    if (mep->stationID == DEV_ID_ANY)
+    if (mep->stationID == DEV_ID_ANY) {
+        UpdateMsgIndex(mep, false); // re-added with the new stationID
         mep->stationID = source; // Still broadcast, set the address
+    }
     uint32_t tstamp = ticker->read_ms();
     mep->responseTime = tstamp + respWindow;
     mep->lastSentTime = 0;
-    mep->channel = channel;
-    mep->factor = factor;
+    mep->fragNext = 0;
+    mep->channel = 0;
+    mep->factor = 0;
+    if (channel <= _channelPlanCount) { // otherwise the data goes via the control channel
+        mep->channel = channel;
+        mep->factor = factor;
+    }
     if (msgFlags & MF_Connect && _securityIntf) {
         mep->flags |= MF_Connect;
-        if (len == sizeof(rme->re->random)+sizeof(rme->re->random2)) {
+        int rlen = sizeof(mep->tmpRandom);
+        if (len == rlen || len == rlen + 1) {
             int shaLen = _securityIntf->GetHashBlockSize();
-            if (shaLen <= (int)sizeof(mep->securityData)) {
+            if (shaLen + ConnectExtSize <= (int)sizeof(mep->securityData)) {
                 memcpy(mep->tmpRandom, data, sizeof(mep->tmpRandom));
-                _securityIntf->HashPassword(data, len, aep->password, aep->pwLen, &mep->securityData);
+                _securityIntf->HashPassword(data, rlen, aep->password, aep->pwLen, &mep->securityData);
                 // dump("shaBuf", &mep->securityData, shaLen);
                 mep->data = &mep->securityData;
                 mep->len = shaLen;
+                /*
+                 * Version 1 stations expect the hash only, our version and
+                 * nonce are added when the station offered a newer version
+                 * after the randoms.
+                 */
+                ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
+                if (len > rlen && cit != _connections.end())
+                    cit->second.peerVersion = ((uint8_t *)data)[rlen];
+                if (_securityIntf->GetSecurityVersion() >= SecurityVersion_v2 &&
+                    cit != _connections.end() && cit->second.peerVersion >= SecurityVersion_v2) {
+                    uint8_t *p = (uint8_t *)mep->securityData + shaLen;
+                    cit->second.nodeRandom[0] = rme->re->radio->Random();
+                    cit->second.nodeRandom[1] = rme->re->radio->Random();
+                    p[0] = _securityIntf->GetSecurityVersion();
+                    memcpy(p + 1, cit->second.nodeRandom, sizeof(cit->second.nodeRandom));
+                    mep->len += ConnectExtSize;
+                }
             }
         }
     }
+    RescheduleMsg(mep);
 
     return true;
 }
@@ -1192,7 +1650,35 @@ RadioShuttle::ProcessRequestMessage(ReceivedMsgEntry *rme, AppEntry *aep, int ms
     if (_wireDumpSettings.recvs)
     	dprintf("ProcessRequestMessage: len=%d msgFlags=0x%x", len, msgFlags);
     
+    if ((!data || (msgFlags & MF_NeedsConfirm)) && _sendPool.Exhausted()) {
+        rme->re->rStats.noMemoryError++;
+        return false; // no space for the response
+    }
+    
+    /*
+     * A repeated slot request shows that our response got lost,
+     * the data of the message shows that it arrived.
+     */
+    if (_radioType >= RS_Station_Basic) {
+        map<devid_t, SignalStrengthEntry>::iterator sit = _signals.find(source);
+        if (sit != _signals.end()) {
+            if (!data) {
+                if (sit->second.slotMsgID == msgID)
+                    UpdateTXPower(rme->re, source, false);
+                sit->second.slotMsgID = msgID;
+            } else if (sit->second.slotMsgID == msgID) {
+                UpdateTXPower(rme->re, source, true);
+                sit->second.slotMsgID = -1;
+            }
+        }
+    }
+    
     if (!data){ // slot request
+        if (msgFlags & MF_Connect && _securityIntf && _connectPool.Exhausted() &&
+            _connections.find(pair<devid_t,int>(source, aep->AppID)) == _connections.end()) {
+            rme->re->rStats.noMemoryError++;
+            return false; // no space for the connection
+        }
         _sends.push_back(SendMsgEntry());
         struct SendMsgEntry &r(_sends.back());
         memset(&r, 0, sizeof(r));
@@ -1201,7 +1687,7 @@ RadioShuttle::ProcessRequestMessage(ReceivedMsgEntry *rme, AppEntry *aep, int ms
 		r.txPower = TX_POWER_AUTO;
         if (msgFlags & MF_Connect && _securityIntf) {
 
-            map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
             if (cit == _connections.end()) {
                 // No connection found, insert and fetch it
                 struct ConnectEntry r;
@@ -1214,9 +1700,23 @@ RadioShuttle::ProcessRequestMessage(ReceivedMsgEntry *rme, AppEntry *aep, int ms
             }
             cit->second.random[0] =  rme->re->random + time(NULL); // TODO better than adding time
             cit->second.random[1] =  rme->re->random2 + time(NULL);
+            cit->second.rxSeq = 0;
             
             r.data = cit->second.random;
             r.len = sizeof(cit->second.random);
+            /*
+             * Newer nodes announce the hash with their version and nonce,
+             * our version offer lets them send it in this Connect.
+             * Version 1 nodes announce the hash only and get the randoms only.
+             */
+            if (len == _securityIntf->GetHashBlockSize() + ConnectExtSize &&
+                _securityIntf->GetSecurityVersion() >= SecurityVersion_v2) {
+                uint8_t *p = (uint8_t *)r.securityData;
+                memcpy(p, cit->second.random, sizeof(cit->second.random));
+                p[sizeof(cit->second.random)] = _securityIntf->GetSecurityVersion();
+                r.data = r.securityData;
+                r.len = sizeof(cit->second.random) + 1;
+            }
             r.flags = MF_Response|MF_Connect;
             r.cep = &cit->second;
             
@@ -1230,75 +1730,91 @@ RadioShuttle::ProcessRequestMessage(ReceivedMsgEntry *rme, AppEntry *aep, int ms
         r.msgID = msgID;
         r.aep = aep;
         if (_radioType >= RS_Station_Basic) { // client request
-            // TODO find a free channel e.g.: r.respWindow = 5000
             r.respWindow = 0;
         } else {
             r.respWindow = 0; // Server sends only if the channel is free, no respWindow needed
         }
             
-        r.channel = 0;		  // TODO use MF_SwitchOptions for other channels
+        r.channel = 0;
         r.factor = 0;
+        r.radioChannel = rme->re->dataChannel;
+        if (_radioType >= RS_Station_Basic && _channelPlanCount && !rme->re->dataChannel && !(r.flags & MF_Connect))
+            AssignDataChannel(rme->re, len, &r); // MF_SwitchOptions tells the node
         r.pStatus = PS_Queued;
         r.retryCount = MAX_SENT_RETRIES-1; // Only one immediate try
+        ScheduleMsg(--_sends.end());
     }
 
-    int addFlags = 0;
+    uint32_t missing = 0;
     if (data && !(msgFlags & MF_Response)) { // Data request
         if (msgFlags & MF_Connect && _securityIntf) {
             
-            map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(source, aep->AppID));
             if (cit == _connections.end())
                 return false;
             
             int shaLen = _securityIntf->GetHashBlockSize();
-            if (len != shaLen)
-                return false; // Invalid connect try
+            if ((len != shaLen && len != shaLen + ConnectExtSize) || len > (int)sizeof(((ConnectVerifyEntry *)0)->data))
+                return false; // Invalid connect try, optionally followed by the node security version and nonce
             
-            uint8_t *shaBuf = new uint8_t[len];
-            if (!shaBuf) {
-                rme->re->rStats.noMemoryError++;
-                return false;
-            }
-            _securityIntf->HashPassword(cit->second.random, sizeof(cit->second.random), aep->password, aep->pwLen, shaBuf);
-            if (memcmp(data, shaBuf, shaLen) == 0) {
-                if (_wireDumpSettings.recvs)
-                	dprintf("Password: Ok");
-                addFlags = MF_Connect;
-                cit->second.authorized = true;
-            } else {
-                if (_wireDumpSettings.recvs)
-                    dprintf("Password: Failed");
-                addFlags = MF_Connect|MF_Authentication;
-            }
-            delete[] shaBuf;
-            if (!(addFlags & MF_Authentication) && cit->second.authorized) {
-                aep->handler(aep->AppID, source, msgID, MS_StationConnected, data, len);
+            ConnectVerifyEntry v;
+            memset(&v, 0, sizeof(v));
+            v.re = rme->re;
+            v.AppID = aep->AppID;
+            v.source = source;
+            v.msgID = msgID;
+            v.msgFlags = msgFlags;
+            memcpy(v.random, cit->second.random, sizeof(v.random));
+            v.received = ticker->read_ms();
+            v.len = len;
+            memcpy(v.data, data, len);
+            
+            if (_verifies) { // Stations verify the passwords together, see BatchVerifyConnects
+                int i;
+                for (i = 0; i < _verifyCount; i++) {
+                    if (_verifies[i].source == source && _verifies[i].AppID == aep->AppID)
+                        break; // a repeated Connect replaces the queued one
+                }
+                if (i == MAX_BATCH_VERIFY) {
+                    BatchVerifyConnects(true);
+                    i = 0;
+                }
+                if (i < _verifyCount)
+                    v.received = _verifies[i].received;
+                else
+                    _verifyCount++;
+                _verifies[i] = v;
+                return true;
             }
-            if (addFlags & MF_Authentication) {
-                aep->handler(aep->AppID, source, msgID, MS_AuthenicationRequired, data, len);
+            ConnectVerified(&v, _securityIntf->VerifyPassword(v.random, sizeof(v.random), aep->password, aep->pwLen, v.data));
+            return true;
+        } else if (aep->aggregate) {
+            /*
+             * Every message of the frame gets delivered on its own
+             */
+            uint8_t *p = (uint8_t *)data;
+            int remain = len;
+            while(remain >= (int)sizeof(AggregateHeader)) {
+                AggregateHeader ah;
+                memcpy(&ah, p, sizeof(ah));
+                p += sizeof(ah);
+                remain -= sizeof(ah);
+                if (ah.msgSize > remain) {
+                    rme->re->rStats.protocolError++;
+                    break;
+                }
+                aep->handler(aep->AppID, source, ah.msgID, MS_RecvData, p, ah.msgSize);
+                p += ah.msgSize;
+                remain -= ah.msgSize;
             }
-
+        } else if (aep->fragmentSize) {
+            if (!ReassembleFragment(rme, aep, source, msgID, data, len, &missing))
+                return false;
         } else {
         	aep->handler(aep->AppID, source, msgID, MS_RecvData, data, len);
         }
-	    if (msgFlags & MF_NeedsConfirm) {
-    	    struct SendMsgEntry r;
-        	memset(&r, 0, sizeof(r));
-	        r.AppID = aep->AppID;
-		r.data = NULL;
-        	r.len = 0;
-        	r.flags = MF_Response | addFlags;
-        	r.stationID = source;
-		r.txPower = TX_POWER_AUTO;
-        	r.msgID = msgID;
-        	r.cep = NULL;
-        	r.aep = aep;
-		r.respWindow = 0;
-        	r.pStatus = PS_Queued;
-        	r.retryCount = MAX_SENT_RETRIES-1; // Only one immediate try
-            
-	        _sends.push_back(r);
-		}
+        if (msgFlags & MF_NeedsConfirm)
+            QueueConfirm(rme->re, aep, source, msgID, MF_Response, &missing, missing ? sizeof(missing) : 0); // the node sends the missing fragments again
     }
     return true;
 }
@@ -1307,9 +1823,12 @@ RadioShuttle::ProcessRequestMessage(ReceivedMsgEntry *rme, AppEntry *aep, int ms
 void
 RadioShuttle::MessageSecurityError(ReceivedMsgEntry *rme, AppEntry *aep, int msgID, devid_t source, uint8_t channel, uint8_t factor)
 {
-	UNUSED(rme);
 	UNUSED(channel);
 	UNUSED(factor);
+    if (_sendPool.Exhausted()) {
+        rme->re->rStats.noMemoryError++;
+        return;
+    }
     struct SendMsgEntry r;
     memset(&r, 0, sizeof(r));
     r.AppID = aep->AppID;
@@ -1321,22 +1840,120 @@ RadioShuttle::MessageSecurityError(ReceivedMsgEntry *rme, AppEntry *aep, int msg
     r.cep = NULL;
     r.aep = aep;
     r.respWindow = 0;
+    r.radioChannel = rme->re->dataChannel;
     r.pStatus = PS_Queued;
     r.retryCount = MAX_SENT_RETRIES-1; // Only one immediate try
     r.releaseData = false;
     
     _sends.push_back(r);
+    ScheduleMsg(--_sends.end());
+}
+
+
+int
+RadioShuttle::ConnectMsgSize(void)
+{
+    int len = _securityIntf->GetHashBlockSize();
+    if (_securityIntf->GetSecurityVersion() >= SecurityVersion_v2)
+        len += ConnectExtSize;
+    return len;
 }
 
 
 void
-RadioShuttle::SaveTimeOnAirSlot(devid_t destination, int AppID, int msgFlags, int respWindow, uint8_t channel, uint8_t factor, int timeOnAir)
+RadioShuttle::AuthorizeConnection(ConnectEntry *cep, AppEntry *aep, bool authorized, devid_t nodeID)
+{
+    if (cep->context) {
+        DestroyConnectionContext(cep->context);
+        cep->context = NULL;
+    }
+    cep->authorized = authorized;
+    if (!authorized || !_securityIntf || !aep->password)
+        return;
+    
+    if (cep->secVersion < SecurityVersion_v2) {
+        cep->context = CreateConnectionContext(aep->password, aep->pwLen);
+        return;
+    }
+    /*
+     * Version 2 uses a session key hashed from the station randoms, the
+     * node nonce, both device IDs and the password. The node nonce gives
+     * a new key even if old station randoms get replayed. The label keeps
+     * it apart from the password hash which is sent during the Connect.
+     */
+    static const char label[] = "RSSessionKey";
+    devid_t ids[2];
+    uint8_t seed[sizeof(cep->random) + sizeof(cep->nodeRandom) + sizeof(ids) + sizeof(label)];
+    uint32_t key[8];
+    
+    if (_securityIntf->GetHashBlockSize() > (int)sizeof(key))
+        return;
+    ids[0] = nodeID;
+    ids[1] = nodeID == _deviceID ? cep->stationID : _deviceID;
+    uint8_t *p = seed;
+    memcpy(p, cep->random, sizeof(cep->random));
+    p += sizeof(cep->random);
+    memcpy(p, cep->nodeRandom, sizeof(cep->nodeRandom));
+    p += sizeof(cep->nodeRandom);
+    memcpy(p, ids, sizeof(ids));
+    p += sizeof(ids);
+    memcpy(p, label, sizeof(label));
+    _securityIntf->HashPassword(seed, sizeof(seed), aep->password, aep->pwLen, key);
+    cep->context = CreateConnectionContext(key, _securityIntf->GetEncryptionBlockSize());
+    memset(key, 0, sizeof(key));
+}
+
+
+void *
+RadioShuttle::CreateConnectionContext(void *key, int keyLen)
+{
+    if (_contextSize <= 0)
+        return _securityIntf->CreateEncryptionContext(key, keyLen);
+    
+    void *memory = _contextPool.Alloc(_contextSize);
+    if (!memory && !_contextPool.Capacity())
+        memory = new uint8_t[_contextSize];
+    if (!memory)
+        return NULL; // the connection stays without encryption
+    if (_securityIntf->InitEncryptionContext(memory, key, keyLen) != memory) {
+        DestroyConnectionContext(memory);
+        return NULL;
+    }
+    return memory;
+}
+
+
+void
+RadioShuttle::DestroyConnectionContext(void *context)
+{
+    if (_contextSize <= 0) {
+        _securityIntf->DestroyEncryptionContext(context);
+        return;
+    }
+    memset(context, 0, _contextSize); // no keys left in the memory
+    if (!_contextPool.Free(context, _contextSize))
+        delete[] (uint8_t *)context;
+}
+
+
+void
+RadioShuttle::SecurityNonce(ConnectEntry *cep, devid_t sender, uint32_t seq, uint8_t *nonce)
+{
+    memcpy(nonce, &cep->random[0], 4);
+    memcpy(nonce + 4, &sender, 4);
+    memcpy(nonce + 8, &seq, 4);
+}
+
+
+void
+RadioShuttle::SaveTimeOnAirSlot(RadioEntry *re, devid_t destination, int AppID, int msgFlags, int respWindow, uint8_t channel, uint8_t factor, int timeOnAir)
 {
 	UNUSED(msgFlags);
     uint32_t tstamp = ticker->read_ms();
 
     struct TimeOnAirSlotEntry r;
     memset(&r, 0, sizeof(r));
+    r.re = re;
     r.stationID = destination;
     r.AppID = AppID;
     r.busy_time = tstamp + respWindow;
@@ -1344,8 +1961,657 @@ RadioShuttle::SaveTimeOnAirSlot(devid_t destination, int AppID, int msgFlags, in
     
     r.channel = channel;
     r.factor = factor;
+    
+    if (channel)
+        return; // The data will be sent on another channel
+    
+    PruneAirtimes(tstamp);
+    
+    uint32_t busyEnd = r.busy_time + r.busy_ms;
+    TimeOnAirSlotList::iterator it;
+    for(it = _airtimes.begin(); it != _airtimes.end(); it++) {
+        if (it->re == re && it->stationID == destination && it->AppID == AppID) {
+            _airtimes.erase(it); // a repeated response replaces the slot
+            break;
+        }
+    }
+    if (_airtimePool.Exhausted() && !_airtimes.empty()) {
+        TimeOnAirSlotEntry *first = &_airtimes.front();
+        if (first->busy_time + first->busy_ms >= busyEnd)
+            return; // all known slots are busy longer
+        _airtimes.pop_front();
+    }
+    
+    it = _airtimes.end();
+    while(it != _airtimes.begin()) {
+        TimeOnAirSlotList::iterator prev = it;
+        prev--;
+        if (prev->busy_time + prev->busy_ms <= busyEnd)
+            break;
+        it = prev;
+    }
+    _airtimes.insert(it, r);
+}
+
+
+void
+RadioShuttle::PruneAirtimes(uint32_t tstamp)
+{
+    while(!_airtimes.empty() && _airtimes.front().busy_time + _airtimes.front().busy_ms <= tstamp)
+        _airtimes.pop_front();
+}
+
+
+uint32_t
+RadioShuttle::AirtimeReserved(RadioEntry *re, uint32_t tstamp, int timeOnAir)
+{
+    PruneAirtimes(tstamp);
+    
+    /*
+     * All remaining slots end after tstamp, the first one which
+     * starts before our send would be done overlaps.
+     * Slots overheard on other radios are on other frequencies.
+     */
+    TimeOnAirSlotList::iterator it;
+    for(it = _airtimes.begin(); it != _airtimes.end(); it++) {
+        if (it->re == re && it->busy_time < tstamp + timeOnAir)
+            return it->busy_time + it->busy_ms;
+    }
+    return 0;
+}
+
+
+bool
+RadioShuttle::AssignDataChannel(RadioEntry *rre, int len, SendMsgEntry *mep)
+{
+    uint32_t tstamp = ticker->read_ms();
+    RadioEntry *dre = NULL;
+    
+    /*
+     * A receiver demodulates a single spreading factor, the adaptive
+     * factor of the node selects among the channels of our data radios,
+     * no radio gets reconfigured for a node.
+     * Without enough SNR history the control channel factor is the minimum.
+     */
+    int minSF = CalculateSpreadingFactor(mep->stationID, rre->profile->SpreadingFaktor);
+    
+    list<RadioEntry>::iterator re;
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        if (!re->dataChannel || re->channelBusyUntil > tstamp)
+            continue;
+        int sf = re->profile->SpreadingFaktor;
+        if (sf < minSF)
+            continue; // the link is too weak for this channel
+        if (re->radio->GetStatus() == RF_TX_RUNNING || re->radio->RxSignalPending())
+            continue;
+        if (!dre || sf < dre->profile->SpreadingFaktor ||
+            (sf == dre->profile->SpreadingFaktor && re->channelBusyUntil < dre->channelBusyUntil))
+            dre = &*re; // lowest factor, idle for the longest time
+    }
+    if (!dre)
+        return false;
+    
+    /*
+     * Our response on the control channel, the data including the
+     * security overhead and the confirmation on the data channel.
+     */
+    int dataLen = sizeof(RadioHeader) + len + sizeof(EncryptionHeader) + 16;
+    int frames = 1;
+    int mtu = dre->radio->MaxMTUSize(dre->modem);
+    if (dataLen > mtu) { // fragmented message
+        frames = (dataLen + mtu - 1) / mtu;
+        dataLen = mtu;
+    }
+    dre->channelBusyUntil = tstamp + rre->radio->TimeOnAir(rre->modem, sizeof(RadioHeader)) +
+        frames * dre->radio->TimeOnAir(dre->modem, dataLen) +
+        dre->radio->TimeOnAir(dre->modem, sizeof(RadioHeader)) + CAD_TIMEOUT_MS;
+    dre->rStats.channelSwitchCount++;
+    
+    mep->channel = dre->dataChannel;
+    mep->factor = dre->profile->SpreadingFaktor - SpreadingFactorBase;
+    return true;
+}
+
+
+bool
+RadioShuttle::SwitchChannel(RadioEntry *re, uint8_t channel, uint8_t factor)
+{
+    if (re->modem != MODEM_LORA || channel > _channelPlanCount)
+        return false;
+    
+    int frequency = re->profile->Frequency;
+    int spreadingFactor = re->profile->SpreadingFaktor;
+    if (channel) {
+        frequency = _channelPlan[channel-1].Frequency;
+        spreadingFactor = _channelPlan[channel-1].SpreadingFaktor;
+    }
+    if (factor)
+        spreadingFactor = factor + SpreadingFactorBase;
+    
+    re->radio->SetChannel(frequency + re->profile->FrequencyOffset);
+    if (_statusIntf)
+        _statusIntf->SetRadioParams(frequency, spreadingFactor);
+    re->radio->SetRxConfig(re->modem, re->profile->Bandwidth, spreadingFactor,
+                           CODING_RATE_4_5, 0, LORA_PREAMBLE_LENGTH,
+                           LORA_SYMBOL_TIMEOUT, false, 0,
+                           true, false, LORA_NB_SYMB_HOP,
+                           false, true);
+    int maxTimeOnAir = re->radio->TimeOnAir(re->modem, re->radio->MaxMTUSize(re->modem));
+    re->radio->SetTxConfig(re->modem, re->lastTxPower, 0, re->profile->Bandwidth,
+                           spreadingFactor, CODING_RATE_4_5,
+                           LORA_PREAMBLE_LENGTH, false,
+                           true, false, LORA_NB_SYMB_HOP,
+                           false, maxTimeOnAir + (maxTimeOnAir / 10));
+    re->radio->Rx(RX_TIMEOUT_30MIN);
+    
+    re->channel = channel;
+    re->factor = factor;
+    if (channel || factor)
+        re->rStats.channelSwitchCount++;
+    if (_wireDumpSettings.sents)
+        dprintf("SwitchChannel: %d (%d Hz, SF %d)", channel, frequency, spreadingFactor);
+    return true;
+}
+
+
+void
+RadioShuttle::ScheduleMsg(SendMsgList::iterator me)
+{
+    me->dueSeq = _scheduleSeq++;
+    me->dueTime = GetDueTime(&*me);
+    me->inFlight = false;
+    me->waitResponse = false;
+    UpdateMsgIndex(&*me, true);
+    _schedule.insert(std::make_pair(pair<uint32_t,uint32_t>(me->dueTime, me->dueSeq), me));
+}
+
+
+void
+RadioShuttle::RescheduleMsg(SendMsgEntry *mep)
+{
+    UpdateMsgIndex(mep, true);
+    
+    uint32_t dueTime = GetDueTime(mep);
+    if (dueTime == mep->dueTime)
+        return;
+    
+    map<pair<uint32_t,uint32_t>, SendMsgList::iterator>::iterator sit = _schedule.find(pair<uint32_t,uint32_t>(mep->dueTime, mep->dueSeq));
+    if (sit == _schedule.end())
+        return;
+    SendMsgList::iterator me = sit->second;
+    _schedule.erase(sit);
+    mep->dueTime = dueTime;
+    _schedule.insert(std::make_pair(pair<uint32_t,uint32_t>(mep->dueTime, mep->dueSeq), me));
+}
+
+
+void
+RadioShuttle::UnscheduleMsg(SendMsgEntry *mep)
+{
+    UpdateMsgIndex(mep, false);
+    _schedule.erase(pair<uint32_t,uint32_t>(mep->dueTime, mep->dueSeq));
+}
+
+
+uint32_t
+RadioShuttle::GetDueTime(SendMsgEntry *mep)
+{
+    uint32_t sentTime = mep->lastSentTime + mep->lastTimeOnAir;
+    
+    switch(mep->pStatus) {
+        case PS_Sent:
+        case PS_WaitForConfirm:
+            if (mep->retryCount >= MAX_SENT_RETRIES && mep->lastSentTime)
+                return sentTime + std::min(mep->confirmTimeout, (uint32_t)mep->retry_ms) + 1;
+            return sentTime + mep->retry_ms + 1;
+        case PS_GotSendSlot:
+            return mep->responseTime;
+        default: // queued or completed
+            return 0;
+    }
+}
+
+
+void
+RadioShuttle::UpdateMsgIndex(SendMsgEntry *mep, bool indexed)
+{
+    bool inFlight = indexed && mep->pStatus > PS_Queued;
+    if (mep->inFlight != inFlight) {
+        mep->inFlight = inFlight;
+        
+        pair<int,devid_t> key(mep->AppID, mep->stationID);
+        if (inFlight) {
+            _inflight[key]++;
+        } else {
+            map<pair<int,devid_t>, int>::iterator it = _inflight.find(key);
+            if (it != _inflight.end() && --it->second <= 0)
+                _inflight.erase(it);
+        }
+    }
+    
+    /*
+     * Only our own requests expect a response, responses never get answered.
+     */
+    bool waitResponse = indexed && !(mep->flags & MF_Response) &&
+    					(mep->pStatus == PS_Sent || mep->pStatus == PS_WaitForConfirm);
+    if (mep->waitResponse != waitResponse) {
+        mep->waitResponse = waitResponse;
+        
+        uint64_t key = ResponseKey(mep->stationID, mep->AppID, mep->msgID);
+        if (waitResponse) {
+            _responses.insert(std::make_pair(key, mep));
+        } else {
+            pair<multimap<uint64_t, SendMsgEntry *>::iterator, multimap<uint64_t, SendMsgEntry *>::iterator> range = _responses.equal_range(key);
+            for (multimap<uint64_t, SendMsgEntry *>::iterator it = range.first; it != range.second; it++) {
+                if (it->second == mep) {
+                    _responses.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+uint64_t
+RadioShuttle::ResponseKey(devid_t stationID, int AppID, int msgID)
+{
+    return ((uint64_t)stationID << 32) | ((uint32_t)(AppID & 0xffff) << 5) | (msgID & msgIDv1Mask);
+}
+
+
+bool
+RadioShuttle::AggregateMsgs(SendMsgEntry *mep)
+{
+    int maxSize = MaxFrameSize(mep->aep, mep->flags, mep->cep);
+    
+    int aggrLen = sizeof(AggregateHeader) + mep->len;
+    uint8_t *frame = new uint8_t[std::max(maxSize, aggrLen)];
+    if (!frame)
+        return false;
+    
+    int flags = mep->flags & ~(MF_LowPriority|MF_HighPriority);
+    SendMsgEntry *last = mep;
+    SendMsgList::iterator me;
+    for(me = _sends.begin(); me != _sends.end(); me++) {
+        if (&*me == mep || me->aggregated || me->aggrData || me->retryCount || me->pStatus != mep->pStatus)
+            continue;
+        if (me->AppID != mep->AppID || me->stationID != mep->stationID ||
+            (me->flags & ~(MF_LowPriority|MF_HighPriority)) != flags)
+            continue;
+        if (aggrLen + (int)sizeof(AggregateHeader) + me->len > maxSize)
+            continue;
+        aggrLen += sizeof(AggregateHeader) + me->len;
+        UnscheduleMsg(&*me); // completed with the mep
+        me->aggregated = true;
+        last->aggrNext = &*me;
+        last = &*me;
+    }
+    
+    uint8_t *p = frame;
+    for(SendMsgEntry *ap = mep; ap; ap = ap->aggrNext) {
+        AggregateHeader ah;
+        ah.msgSize = ap->len;
+        ah.msgID = ap->msgID & msgIDv1Mask;
+        memcpy(p, &ah, sizeof(ah));
+        p += sizeof(ah);
+        if (ap->len)
+            memcpy(p, ap->data, ap->len);
+        p += ap->len;
+    }
+    mep->aggrData = frame;
+    mep->aggrLen = aggrLen;
+    
+    return true;
+}
+
+
+int
+RadioShuttle::MaxFrameSize(AppEntry *aep, int flags, ConnectEntry *cep)
+{
+    int maxSize;
+    if (MaxMessageSize(&maxSize, flags, cep ? cep->AppID : 0, cep ? cep->stationID : DEV_ID_ANY) != RS_NoErr)
+        return 0;
+    if (aep && aep->compress)
+        maxSize--; // compression version
+    return maxSize;
+}
+
+
+bool
+RadioShuttle::CompressFrame(RadioEntry *re, int AppID, void **data, int *len)
+{
+    if (!re->zBuffer)
+        re->zBuffer = new uint8_t[re->rxBufferSize];
+    if (!re->zBuffer || *len + 1 > re->rxBufferSize) {
+        re->rStats.noMemoryError++;
+        return false;
+    }
+    
+    /*
+     * The frame is sent compressed if it saves at least a byte,
+     * otherwise as is behind the 0 version.
+     */
+    uint8_t *z = re->zBuffer;
+    int zlen = -1;
+    if (_compressionIntf)
+        zlen = _compressionIntf->Compress(AppID, *data, *len, z + 1, *len - 1);
+    if (zlen > 0) {
+        z[0] = _compressionIntf->GetCompressionVersion();
+    } else {
+        z[0] = 0;
+        zlen = *len;
+        memcpy(z + 1, *data, zlen);
+    }
+    *data = z;
+    *len = zlen + 1;
+    return true;
+}
+
+
+bool
+RadioShuttle::DecompressFrame(RadioEntry *re, int AppID, void **data, int *len)
+{
+    uint8_t *p = (uint8_t *)*data;
+    
+    if (p[0] == 0) { // sent uncompressed
+        *data = p + 1;
+        *len -= 1;
+        return true;
+    }
+    if (!_compressionIntf || p[0] != _compressionIntf->GetCompressionVersion()) {
+        re->rStats.decompressError++;
+        return false;
+    }
+    if (!re->zBuffer)
+        re->zBuffer = new uint8_t[re->rxBufferSize];
+    if (!re->zBuffer) {
+        re->rStats.noMemoryError++;
+        return false;
+    }
+    int zlen = _compressionIntf->Decompress(AppID, p + 1, *len - 1, re->zBuffer, re->rxBufferSize);
+    if (zlen < 0) {
+        re->rStats.decompressError++;
+        return false;
+    }
+    *data = re->zBuffer;
+    *len = zlen;
+    return true;
+}
+
+
+int
+RadioShuttle::NextFragment(SendMsgEntry *mep, int index)
+{
+    for (; index < mep->fragCount; index++) {
+        if (!(mep->fragAcked & (1UL << index)))
+            return index;
+    }
+    return -1;
+}
+
+
+int
+RadioShuttle::BuildFragment(SendMsgEntry *mep, int index)
+{
+    if (!mep->fragData) {
+        mep->fragData = new uint8_t[sizeof(FragmentHeader) + mep->fragSize];
+        if (!mep->fragData)
+            return -1;
+    }
+    
+    int offset = index * mep->fragSize;
+    int size = std::min(mep->fragSize, mep->len - offset);
+    FragmentHeader fh;
+    fh.msgSize = mep->len;
+    fh.index = index;
+    fh.offset = offset;
+    fh.last = mep->fragCount - 1;
+    memcpy(mep->fragData, &fh, sizeof(fh));
+    if (size > 0)
+        memcpy(mep->fragData + sizeof(fh), (uint8_t *)mep->data + offset, size);
+    
+    return sizeof(fh) + std::max(size, 0);
+}
+
+
+bool
+RadioShuttle::ReassembleFragment(ReceivedMsgEntry *rme, AppEntry *aep, devid_t source, int msgID, void *data, int len, uint32_t *missing)
+{
+    FragmentHeader fh;
+    if (len < (int)sizeof(fh)) {
+        rme->re->rStats.protocolError++;
+        return false;
+    }
+    memcpy(&fh, data, sizeof(fh));
+    uint8_t *p = (uint8_t *)data + sizeof(fh);
+    int size = len - sizeof(fh);
+    if (fh.msgSize > aep->fragmentSize || fh.index > fh.last || fh.offset + size > fh.msgSize) {
+        rme->re->rStats.protocolError++;
+        return false;
+    }
+    
+    /*
+     * An entry is kept for the retries of the sender only, a known fragment
+     * must have the same data sum to be a repeat of the same message.
+     */
+    uint32_t tstamp = ticker->read_ms();
+    uint32_t retryWindow = (MAX_SENT_RETRIES + 1) * 2 * rme->re->maxTimeOnAir;
+    uint16_t sum = GetDataSum(16, p, size);
+    pair<devid_t,int> key(source, aep->AppID);
+    map<pair<devid_t,int>, ReassemblyEntry>::iterator it = _reassembly.find(key);
+    if (it != _reassembly.end() && (fh.last == 0 || it->second.msgID != msgID || it->second.msgSize != fh.msgSize ||
+        tstamp - it->second.lastUpdate > retryWindow ||
+        (!(it->second.missing & (1UL << fh.index)) && it->second.sums[fh.index] != sum))) {
+        if (it->second.buffer) // a new message replaces the previous one
+            delete[] it->second.buffer;
+        _reassembly.erase(it);
+        it = _reassembly.end();
+    }
+    *missing = 0;
+    if (fh.last == 0) {
+        aep->handler(aep->AppID, source, msgID, MS_RecvData, p, size);
+        return true;
+    }
+    
+    if (it == _reassembly.end()) {
+        if ((int)_reassembly.size() >= MAX_REASSEMBLY) {
+            map<pair<devid_t,int>, ReassemblyEntry>::iterator oldest = _reassembly.begin();
+            for(it = _reassembly.begin(); it != _reassembly.end(); it++) {
+                if (it->second.lastUpdate < oldest->second.lastUpdate)
+                    oldest = it;
+            }
+            if (oldest->second.buffer)
+                delete[] oldest->second.buffer;
+            _reassembly.erase(oldest);
+        }
+        struct ReassemblyEntry r;
+        memset(&r, 0, sizeof(r));
+        r.msgID = msgID;
+        r.msgSize = fh.msgSize;
+        r.missing = (uint32_t)((2UL << fh.last) - 1);
+        r.buffer = new uint8_t[fh.msgSize];
+        if (!r.buffer) {
+            rme->re->rStats.noMemoryError++;
+            return false;
+        }
+        it = _reassembly.insert(std::make_pair(key, r)).first;
+    }
+    
+    /*
+     * Repeated fragments are ignored, the completed entry is kept
+     * without its buffer to confirm a repeated burst again.
+     */
+    ReassemblyEntry &r(it->second);
+    r.lastUpdate = tstamp;
+    if (r.missing & (1UL << fh.index)) {
+        memcpy(r.buffer + fh.offset, p, size);
+        r.sums[fh.index] = sum;
+        r.missing &= ~(1UL << fh.index);
+        if (!r.missing) {
+            aep->handler(aep->AppID, source, msgID, MS_RecvData, r.buffer, r.msgSize);
+            delete[] r.buffer;
+            r.buffer = NULL;
+        }
+    }
+    *missing = r.missing;
+    return true;
+}
+
+
+RadioShuttle::SendMsgEntry *
+RadioShuttle::FindResponseMsg(devid_t source, int AppID, int msgID)
+{
+    multimap<uint64_t, SendMsgEntry *>::iterator it = _responses.find(ResponseKey(source, AppID, msgID));
+    if (it == _responses.end()) // Requests sent to DEV_ID_ANY get answered by any station
+        it = _responses.find(ResponseKey(DEV_ID_ANY, AppID, msgID));
+    if (it == _responses.end())
+        return NULL;
+    return it->second;
+}
+
+
+void
+RadioShuttle::CompleteMsg(SendMsgList::iterator me)
+{
+    /*
+     * The messages sent within our frame share the result
+     */
+    SendMsgEntry *ap = me->aggrNext;
+    me->aggrNext = NULL;
+    while(ap) {
+        SendMsgEntry *next = ap->aggrNext;
+        ap->aggrNext = NULL;
+        ap->pStatus = me->pStatus;
+        SendMsgList::iterator ae;
+        for(ae = _sends.begin(); ae != _sends.end(); ae++) {
+            if (&*ae == ap) {
+                CompleteMsg(ae);
+                break;
+            }
+        }
+        ap = next;
+    }
+    
+    map<int, AppEntry>::iterator it = _apps.find(me->AppID);
+    if(it != _apps.end()) {
+        int status = MS_SentCompleted;
+        if (me->pStatus == PS_SendTimeout)
+            status = MS_SentTimeout;
+        else if (me->pStatus == PS_SendRequestCompleted)
+            status = MS_SentCompleted;
+        else if (me->pStatus == PS_SendRequestConfirmed)
+            status = MS_SentCompletedConfirmed;
+        
+        if (me->flags != MF_Response) {
+            if (me->pStatus == PS_SendTimeout) {
+                if (!me->aggregated) { // once per frame, for the radio which sent it
+                    RadioEntry *rp = NULL;
+                    list<RadioEntry>::iterator re;
+                    for(re = _radios.begin(); re != _radios.end(); re++) {
+                        if (re->channelMsg == &*me || (!rp && re->dataChannel == me->radioChannel))
+                            rp = &*re;
+                    }
+                    UpdateTXPower(rp ? rp : &_radios.front(), me->stationID, false);
+                }
+                if (_statusIntf)
+                    _statusIntf->MessageTimeout(me->AppID, me->stationID);
+            }
+            it->second.handler(me->AppID, me->stationID, me->msgID, status, me->data, me->len);
+        }
+    }
+    
+    list<RadioEntry>::iterator re;
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        if (re->channelMsg == &*me) { // timeout on the data channel
+            SwitchChannel(&*re, 0, 0);
+            re->channelMsg = NULL;
+        }
+    }
+    
+    if (me->releaseData)
+        delete[] (uint8_t *)me->data;
+    if (me->aggrData)
+        delete[] me->aggrData;
+    if (me->fragData)
+        delete[] me->fragData;
+    UnscheduleMsg(&*me);
+    _sends.erase(me);
+}
+
 
-    // _airtimes.push_back(r); // TODO we need to test this with a third client
+void
+RadioShuttle::RemoveMsg(SendMsgList::iterator me)
+{
+    if (me->aggregated) {
+        /*
+         * A frame not yet sent gets built again without us,
+         * otherwise our data is on the air already.
+         */
+        SendMsgList::iterator ae;
+        for(ae = _sends.begin(); ae != _sends.end(); ae++) {
+            if (!ae->aggrData || ae->aggregated)
+                continue;
+            SendMsgEntry *ap;
+            for(ap = &*ae; ap && ap->aggrNext != &*me; ap = ap->aggrNext)
+                ;
+            if (!ap)
+                continue;
+            if (ae->pStatus == PS_Queued) {
+                SplitFrame(&*ae);
+            } else {
+                ap->aggrNext = me->aggrNext;
+                me->aggrNext = NULL;
+                me->aggregated = false;
+            }
+            break;
+        }
+    } else if (me->aggrData) {
+        SplitFrame(&*me);
+    }
+    
+    list<RadioEntry>::iterator re;
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        if (re->channelMsg == &*me) { // back to the control channel
+            SwitchChannel(&*re, 0, 0);
+            re->channelMsg = NULL;
+        }
+    }
+    
+    if (me->releaseData)
+        delete[] (uint8_t *)me->data;
+    if (me->aggrData)
+        delete[] me->aggrData;
+    if (me->fragData)
+        delete[] me->fragData;
+    UnscheduleMsg(&*me);
+    _sends.erase(me);
+}
+
+
+void
+RadioShuttle::SplitFrame(SendMsgEntry *mep)
+{
+    SendMsgEntry *ap = mep->aggrNext;
+    mep->aggrNext = NULL;
+    while(ap) {
+        SendMsgEntry *next = ap->aggrNext;
+        ap->aggrNext = NULL;
+        ap->aggregated = false;
+        SendMsgList::iterator ae;
+        for(ae = _sends.begin(); ae != _sends.end(); ae++) {
+            if (&*ae == ap) {
+                ScheduleMsg(ae);
+                break;
+            }
+        }
+        ap = next;
+    }
+    if (mep->aggrData) {
+        delete[] mep->aggrData;
+        mep->aggrData = NULL;
+    }
+    mep->aggrLen = 0;
 }
 
 
@@ -1433,43 +2699,75 @@ RadioShuttle::SendMessage(RadioEntry *re, void *data, int len, int msgID, int Ap
     /*
      * Packet compression and encryption goes here
      */
+    if (data && len > 0 && !(flags & (MF_Connect|MF_Response))) {
+        map<int, AppEntry>::iterator it = _apps.find(AppID);
+        if (it != _apps.end() && it->second.compress) {
+            if (!CompressFrame(re, AppID, &data, &len))
+                return false;
+            rh.s.data.msgSize = len + hlen;
+        }
+    }
     uint8_t *crypteddata = NULL;
     int newlen = 0;
+    int sendlen = len;
 
     if (_securityIntf && data && flags & MF_Encrypted) {
         map<int, AppEntry>::iterator it = _apps.find(AppID);
         if(it != _apps.end() && it->second.password) {
-            map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(stationID, AppID));
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(stationID, AppID));
             if (cit != _connections.end()) {
                 if (!cit->second.authorized)
                     return false;
-                EncryptionHeader eh;
-                eh.version = _securityIntf->GetSecurityVersion();
-                eh.dataSum = GetDataSum(DataSumBits, data, len);
-                eh.msgSize = rh.s.data.msgSize;
-                eh.msgID = rh.s.data.msgID;
-                eh.random = cit->second.random[0];
-                
-                newlen = len + sizeof(EncryptionHeader);
-                int bsize =_securityIntf->GetEncryptionBlockSize();
-                int remain = newlen % bsize; // Pad to block size
-                if (remain)
-                    newlen += bsize - remain;
-                uint8_t *newdata = new uint8_t[newlen];
-                crypteddata = new uint8_t[newlen];
-                if (newdata == NULL || crypteddata == NULL) {
-                    if (newdata)
-                        delete[] newdata;
+                if (!cit->second.context) {
                     re->rStats.noMemoryError++;
                     return false;
                 }
-                memcpy(newdata, &eh, sizeof(eh));
-                memcpy(newdata + sizeof(eh), data, len);
-
-                void *context = _securityIntf->CreateEncryptionContext(it->second.password, it->second.pwLen);
-                _securityIntf->EncryptMessage(context, newdata, crypteddata, newlen);
-                _securityIntf->DestroyEncryptionContext(context);
-                delete[] newdata;
+                bool v2 = cit->second.secVersion >= SecurityVersion_v2;
+                if (v2) {
+                    newlen = SecuritySeqSize_v2 + len + SecurityTagSize_v2;
+                } else {
+                    newlen = len + sizeof(EncryptionHeader);
+                    int bsize =_securityIntf->GetEncryptionBlockSize();
+                    int remain = newlen % bsize; // Pad to block size
+                    if (remain)
+                        newlen += bsize - remain;
+                }
+                if (newlen + hlen > re->txBufferSize) {
+                    if (_wireDumpSettings.sents)
+                        dprintf("Encrypted message too large");
+                    return false;
+                }
+                crypteddata = re->txBuffer;
+                if (v2) {
+                    /*
+                     * Sequence, data and tag, the RadioHeader is authenticated
+                     * as additional data, the ciphertext has the data length.
+                     */
+                    uint8_t nonce[SecurityNonceSize_v2];
+                    uint32_t seq = ++cit->second.txSeq;
+                    SecurityNonce(&cit->second, _deviceID, seq, nonce);
+                    memcpy(crypteddata, &seq, SecuritySeqSize_v2);
+                    memcpy(crypteddata + SecuritySeqSize_v2, data, len);
+                    if (!_securityIntf->EncryptAuthMessage(cit->second.context, nonce, sizeof(nonce), &rh, hlen,
+                            crypteddata + SecuritySeqSize_v2, len, crypteddata + SecuritySeqSize_v2 + len, SecurityTagSize_v2))
+                        return false;
+                } else {
+                    /*
+                     * The header, data and padding are placed in the radio TX buffer
+                     * and get encrypted in place, the data sum is done while copying.
+                     */
+                    EncryptionHeader eh;
+                    eh.version = SecurityVersion_v1;
+                    eh.dataSum = DataSumFold(DataSumBits, DataSumAdd(0, data, len, crypteddata + sizeof(eh)));
+                    eh.msgSize = rh.s.data.msgSize;
+                    eh.msgID = rh.s.data.msgID;
+                    eh.random = cit->second.random[0];
+                    memcpy(crypteddata, &eh, sizeof(eh));
+                    memset(crypteddata + sizeof(eh) + len, 0, newlen - (sizeof(eh) + len));
+
+                    _securityIntf->EncryptMessage(cit->second.context, crypteddata, crypteddata, newlen);
+                }
+                sendlen = newlen;
                 if (_wireDumpSettings.sents)
 					dump("EncryptedData", crypteddata, newlen);
             }
@@ -1490,12 +2788,8 @@ RadioShuttle::SendMessage(RadioEntry *re, void *data, int len, int msgID, int Ap
             re->radio->Send(data, len, &rh, hlen); // Response state
     }
     re->txDoneReceived = false;
-    re->lastTxSize = len + hlen;
+    re->lastTxSize = (data ? sendlen : 0) + hlen; // slot requests announce the size only
     PacketTrace(re, "TxSend", &rh, data, data == NULL ? 0 : len, true, NULL);
-
-    if (crypteddata) {
-        delete[] crypteddata;
-	}
 	
 	return true;
 }
@@ -1512,34 +2806,50 @@ RadioShuttle::CalculateTXPower(RadioEntry *re, devid_t stationID)
         return maxTXPower;
     }
     
-    int rx_dBm = it->second.rx_dBm;
-    int txpower = maxTXPower;
-
-    if (!rx_dBm)
+    int txpower = it->second.txPower;
+    if (!txpower || txpower > maxTXPower)
         return maxTXPower;
-    
-    if (rx_dBm < -80) 		// Far away
-        txpower = maxTXPower;
-    else if (rx_dBm < -70) // A few hundred meters away
-        txpower = 14;
-    else if (rx_dBm < -60)	// Same building, 40 meters
-        txpower = 10;
-    else if (rx_dBm < -50)	// Very closed nearby 20 meters
-        txpower = 6;
-    else if (rx_dBm < -40) 	// 40 dBm stations are next to each other
-        txpower = 2;
-    else
-		txpower = 2;
-
-	if (txpower > maxTXPower)
-		txpower = maxTXPower;
 
     return txpower;
 }
 
 
+void
+RadioShuttle::UpdateTXPower(RadioEntry *re, devid_t stationID, bool delivered)
+{
+    map<devid_t, SignalStrengthEntry>::iterator it = _signals.find(stationID);
+    if(it == _signals.end())
+        return;
+    
+    SignalStrengthEntry *sp = &it->second;
+    int maxTXPower = re->profile->TXPower;
+    int txpower = CalculateTXPower(re, stationID);
+    
+    if (!delivered) {
+        txpower += TXP_STEP_UP;
+        sp->txDelivered = 0;
+    } else if (++sp->txDelivered >= TXP_DELIVERIES) {
+        /*
+         * Our received SNR estimates the link assuming that the station sends
+         * with our profile power, it must keep the margin with the lower power.
+         */
+        int sf = re->factor ? re->factor + SpreadingFactorBase : re->profile->SpreadingFaktor;
+        int margin10 = sp->snr10 - ((maxTXPower - txpower) + TXP_STEP_DOWN) * 10 - SNRLimit10(sf);
+        if (margin10 >= TXP_SNR_MARGIN * 10)
+            txpower -= TXP_STEP_DOWN;
+        sp->txDelivered = 0;
+    }
+    
+    if (txpower < TXP_MIN_POWER)
+        txpower = TXP_MIN_POWER;
+    if (txpower > maxTXPower)
+        txpower = maxTXPower;
+    sp->txPower = txpower;
+}
+
+
 bool
-RadioShuttle::UpdateSignalStrength(devid_t stationID, int dBm)
+RadioShuttle::UpdateSignalStrength(devid_t stationID, int dBm, int snr)
 {
     uint32_t oldestUpdate = ~0;
     
@@ -1548,6 +2858,11 @@ RadioShuttle::UpdateSignalStrength(devid_t stationID, int dBm)
         it->second.rx_dBm = dBm;
         it->second.lastUpdate = time(NULL);
         it->second.rcnCnt++;
+        int sum = it->second.snr10 * 3 + snr * 10;
+        if (snr * 10 < it->second.snr10)
+            it->second.snr10 = snr * 10;
+        else // rounded average, the sum may be negative
+            it->second.snr10 = sum >= 0 ? (sum + 2) / 4 : -((-sum + 2) / 4);
         return false;
     }
 
@@ -1584,6 +2899,8 @@ RadioShuttle::UpdateSignalStrength(devid_t stationID, int dBm)
     r.rx_dBm = dBm;
     r.stationID = stationID;
     r.lastUpdate = time(NULL);
+    r.snr10 = snr * 10;
+    r.slotMsgID = -1;
     
     _signals.insert(std::pair<devid_t,SignalStrengthEntry> (stationID, r));
 
@@ -1608,6 +2925,21 @@ RadioShuttle::DeleteSignalStrength(devid_t stationID)
 }
 
 
+int
+RadioShuttle::CalculateSpreadingFactor(devid_t stationID, int defaultSF)
+{
+    map<devid_t, SignalStrengthEntry>::iterator it = _signals.find(stationID);
+    if(it == _signals.end() || !it->second.rcnCnt)
+        return defaultSF; // not enough packets received
+    
+    int snr10 = it->second.snr10;
+    int sf = 7;
+    while(sf < 12 && snr10 < SNRLimit10(sf) + SF_SNR_MARGIN * 10)
+        sf++;
+    return sf;
+}
+
+
 bool
 RadioShuttle::ReceiveMessage(ReceivedMsgEntry *rme,  void **data, int &len, int &msgID, int & AppID, int &flags, devid_t &destination, devid_t &source, int &respWindow, uint8_t &channel, uint8_t &factor)
 {
@@ -1668,6 +3000,36 @@ RadioShuttle::ReceiveMessage(ReceivedMsgEntry *rme,  void **data, int &len, int
 
     
     if (destination != DEV_ID_ANY && destination !=  _deviceID) {
+        /*
+         * Overheard traffic of other stations, a response grants the
+         * destination a send slot for the size of its last request
+         * on this radio.
+         */
+        RadioEntry *re = rme->re;
+        if (flags & MF_Response) {
+            int requestLen = 0;
+            for (int i = 0; i < OVERHEARD_REQUESTS; i++) {
+                if (re->requests[i].source == destination && re->requests[i].AppID == AppID) {
+                    requestLen = re->requests[i].len;
+                    break;
+                }
+            }
+            int timeOnAir = re->radio->TimeOnAir(re->modem, requestLen + sizeof(RadioHeader));
+            SaveTimeOnAirSlot(re, destination, AppID, flags, respWindow, channel, factor, timeOnAir);
+        } else {
+            int i;
+            for (i = 0; i < OVERHEARD_REQUESTS; i++) {
+                if (re->requests[i].source == source && re->requests[i].AppID == AppID)
+                    break;
+            }
+            if (i == OVERHEARD_REQUESTS) {
+                i = re->nextRequest;
+                re->nextRequest = (re->nextRequest + 1) % OVERHEARD_REQUESTS;
+            }
+            re->requests[i].source = source;
+            re->requests[i].AppID = AppID;
+            re->requests[i].len = len;
+        }
         rme->re->rStats.protocolError++;
         return false;
     }
@@ -1675,50 +3037,98 @@ RadioShuttle::ReceiveMessage(ReceivedMsgEntry *rme,  void **data, int &len, int
     if (rme->RxSize > hlen)
     	*data = (uint8_t *)rme->RxData + hlen;
     
-    UpdateSignalStrength(source, rme->rssi);
+    UpdateSignalStrength(source, rme->rssi, rme->snr);
     /*
-     * Packet de-compression and de-encryption goes here (later)
+     * Packet de-encryption and de-compression
      */
     if (_securityIntf && *data && flags & MF_Encrypted) {
         map<int, AppEntry>::iterator it = _apps.find(AppID);
         if(it != _apps.end() && it->second.password) {
-            map<pair<devid_t,int>, ConnectEntry>::iterator cit = _connections.find(pair<devid_t,int>(source, AppID));
+            ConnectMap::iterator cit = _connections.find(pair<devid_t,int>(source, AppID));
             if (cit != _connections.end()) {
                 
-                if ((rme->RxSize-hlen) % _securityIntf->GetEncryptionBlockSize() > 0)
-                    return false;
-                uint8_t *crypteddata = new uint8_t[rme->RxSize-hlen];
-                if (!crypteddata) {
-                    rme->re->rStats.noMemoryError++;
-                    return false;
-                }
-                memcpy(crypteddata, *data, rme->RxSize-hlen);
-                
-                void *context = _securityIntf->CreateEncryptionContext(it->second.password, it->second.pwLen);
-                _securityIntf->DecryptMessage(context, crypteddata, *data, rme->RxSize-hlen);
-                _securityIntf->DestroyEncryptionContext(context);
-                delete[] crypteddata;
-                EncryptionHeader *eh = (EncryptionHeader *)*data;
-                *data = ((uint8_t *)*data) + sizeof(EncryptionHeader);
-                bool decryptError = false;
-                if (eh->version != _securityIntf->GetSecurityVersion())
-                    decryptError = true;
-                if (eh->dataSum != GetDataSum(DataSumBits, *data, eh->msgSize-hlen))
-                    decryptError = true;
-                if (eh->msgID != msgID)
-                    decryptError = true;
-                if (eh->random != cit->second.random[0])
-                    decryptError = true;
-                if (eh->msgSize !=  len + hlen)
-                    decryptError = true;
-                if (decryptError) {
+                int bsize = _securityIntf->GetEncryptionBlockSize();
+                int cryptlen = rme->RxSize-hlen;
+                if (!cit->second.context) { // not authorized
                     rme->re->rStats.decryptError++;
                     return false;
                 }
-                if (_wireDumpSettings.recvs)
-	                dump("Decrypted Ok", *data, len);
+                if (cit->second.secVersion >= SecurityVersion_v2) {
+                    uint8_t *seqdata = (uint8_t *)*data;
+                    uint8_t nonce[SecurityNonceSize_v2];
+                    uint32_t seq;
+                    
+                    if (cryptlen != SecuritySeqSize_v2 + len + SecurityTagSize_v2) {
+                        rme->re->rStats.decryptError++;
+                        return false;
+                    }
+                    memcpy(&seq, seqdata, SecuritySeqSize_v2);
+                    if (seq <= cit->second.rxSeq) { // Replayed or old packet
+                        rme->re->rStats.decryptError++;
+                        return false;
+                    }
+                    SecurityNonce(&cit->second, source, seq, nonce);
+                    if (!_securityIntf->DecryptAuthMessage(cit->second.context, nonce, sizeof(nonce), rme->RxData, hlen,
+                            seqdata + SecuritySeqSize_v2, len, seqdata + SecuritySeqSize_v2 + len, SecurityTagSize_v2)) {
+                        rme->re->rStats.decryptError++;
+                        return false;
+                    }
+                    cit->second.rxSeq = seq;
+                    *data = seqdata + SecuritySeqSize_v2;
+                    if (_wireDumpSettings.recvs)
+                        dump("Decrypted Ok", *data, len);
+                } else {
+                    if (cryptlen % bsize > 0)
+                        return false;
+                    /*
+                     * Decrypt in place, the first block contains the EncryptionHeader
+                     * which gets verified before the remaining blocks are decrypted.
+                     */
+                    uint8_t *crypteddata = (uint8_t *)*data;
+                    _securityIntf->DecryptMessage(cit->second.context, crypteddata, crypteddata, bsize);
+                    EncryptionHeader *eh = (EncryptionHeader *)crypteddata;
+                    bool decryptError = false;
+                    if (eh->version != SecurityVersion_v1)
+                        decryptError = true;
+                    if (eh->msgID != msgID)
+                        decryptError = true;
+                    if (eh->random != cit->second.random[0])
+                        decryptError = true;
+                    if (eh->msgSize !=  len + hlen)
+                        decryptError = true;
+                    if (len + (int)sizeof(EncryptionHeader) > cryptlen)
+                        decryptError = true;
+                    if (decryptError) {
+                        rme->re->rStats.decryptError++;
+                        return false;
+                    }
+                    /*
+                     * The remaining blocks are decrypted in chunks of four blocks,
+                     * each chunk gets summed up while it is still in the cache.
+                     */
+                    int dataEnd = sizeof(EncryptionHeader) + len;
+                    uint32_t sum = DataSumAdd(0, crypteddata + sizeof(EncryptionHeader), min(dataEnd, bsize) - (int)sizeof(EncryptionHeader));
+                    for (int off = bsize; off < cryptlen; off += 4 * bsize) {
+                        int chunk = min(4 * bsize, cryptlen - off);
+                        _securityIntf->DecryptMessage(cit->second.context, crypteddata + off, crypteddata + off, chunk);
+                        if (off < dataEnd)
+                            sum = DataSumAdd(sum, crypteddata + off, min(chunk, dataEnd - off));
+                    }
+                    *data = crypteddata + sizeof(EncryptionHeader);
+                    if (eh->dataSum != DataSumFold(DataSumBits, sum)) {
+                        rme->re->rStats.decryptError++;
+                        return false;
+                    }
+                    if (_wireDumpSettings.recvs)
+    	                dump("Decrypted Ok", *data, len);
+                }
             }
         }
+    }
+    if (*data && len > 0 && !(flags & (MF_Connect|MF_Response))) {
+        map<int, AppEntry>::iterator it = _apps.find(AppID);
+        if (it != _apps.end() && it->second.compress && !DecompressFrame(rme->re, AppID, data, &len))
+            return false;
     }
 	if (_receiveHandler) {
 		flags = 0;
@@ -1841,23 +3251,30 @@ RadioShuttle::PacketTrace(RadioEntry *re, const char *name, RadioHeader *rh, voi
 
 
 bool
-RadioShuttle::CadDetection(RadioEntry *re)
+RadioShuttle::CadDetection(RadioEntry *re, uint32_t tstamp)
 {
-    re->_CADdetected = -1;
-    int msec = 50;
-    Timer t;
-    t.start();
+    if (re->cadRunning && re->_CADdetected != -1 && tstamp - re->cadStartTime > (uint32_t)CAD_TIMEOUT_MS)
+        re->cadRunning = false; // outdated result, check again
     
-    re->radio->StartCad();
-    if (_wireDumpSettings.recvs)
-        dprintf("CadStart");
-
-    while(t.read_ms() < msec) {
-    	// Wait for the CAD interrupt
-        if (re->_CADdetected != -1)
-        	break;
+    if (!re->cadRunning) {
+        re->_CADdetected = -1;
+        re->cadRunning = true;
+        re->cadStartTime = tstamp;
+        
+        re->radio->StartCad();
+        if (_wireDumpSettings.recvs)
+            dprintf("CadStart");
+        return true; // wait for the RS_CadDone
     }
-
+    
+    if (re->_CADdetected == -1) {
+        if (tstamp >= re->cadStartTime && tstamp < re->cadStartTime + CAD_TIMEOUT_MS)
+            return true; // still running
+        re->cadRunning = false; // no CAD interrupt, consider the channel free
+        return false;
+    }
+    
+    re->cadRunning = false;
     if (re->_CADdetected == 1)
     	return true;
     else
@@ -1892,10 +3309,25 @@ RadioShuttle::RS_RxDone(Radio *radio, void *userData, uint8_t *payload, uint16_t
     re->rStats.RxPackets++;
 	re->rStats.lastRSSI = rssi;
 	re->rStats.lastSNR = snr;
-    re->rxMsg.RxData = payload;
-    re->rxMsg.RxSize = size;
-    re->rxMsg.rssi = rssi;
-    re->rxMsg.snr = snr;
+    /*
+     * Copy the packet out of the radio buffer into the next free ring slot,
+     * the radio buffer is overwritten by the next packet.
+     */
+    uint8_t rxHead = re->rxHead;
+    uint8_t next = (rxHead + 1) & (RX_RING_SLOTS-1);
+    if (next == re->rxTail) {
+        re->rStats.rxOverflowCount++;
+    } else {
+        ReceivedMsgEntry *rx = &re->rxRing[rxHead];
+        if (size > re->rxBufferSize)
+            size = re->rxBufferSize;
+        memcpy(rx->RxData, payload, size);
+        rx->RxSize = size;
+        rx->rssi = rssi;
+        rx->snr = snr;
+        RS_MEMORY_BARRIER(); // slot data before the index update
+        re->rxHead = next;
+    }
     RadioHeader *rh = (RadioHeader *)payload;
     if (rh->magic != RSMagic || !(rh->version == RSHeaderFully_v1 || rh->version == RSHeaderPacked_v1)) {
         /*
@@ -1991,6 +3423,57 @@ RadioShuttle::RS_CadDone(Radio *radio, void *userData, bool channelActivityDetec
 }
 
 
+uint32_t
+RadioShuttle::PlanWakeup(uint32_t txGuardEnd)
+{
+    /*
+     * The first entry with a dueTime in the _schedule is the nearest
+     * send retry, response window or confirm timeout. Queued messages (dueTime 0)
+     * are waiting for the radio and not for the timer, unless a TX guard
+     * time blocked them.
+     */
+    uint32_t time_abs = txGuardEnd;
+    
+    map<pair<uint32_t,uint32_t>, SendMsgList::iterator>::iterator sit = _schedule.lower_bound(pair<uint32_t,uint32_t>(1, 0));
+    if (sit != _schedule.end() && sit->first.first < time_abs)
+        time_abs = sit->first.first;
+    
+    if (_verifyCount && _verifies[0].received + BATCH_VERIFY_MS < time_abs)
+        time_abs = _verifies[0].received + BATCH_VERIFY_MS; // verify the queued Connect passwords
+    
+    list<RadioEntry>::iterator re;
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        if (re->cadRunning && re->cadStartTime + CAD_TIMEOUT_MS < time_abs)
+            time_abs = re->cadStartTime + CAD_TIMEOUT_MS; // wakeup if RS_CadDone gets lost
+    }
+    
+    _nextWakeup = time_abs;
+    return time_abs;
+}
+
+
+int
+RadioShuttle::NextWakeup(void)
+{
+    if (busyInShuttle || _recvs.size() > 0)
+        return 0;
+    
+    list<RadioEntry>::iterator re;
+    for(re = _radios.begin(); re != _radios.end(); re++) {
+        if (re->rxHead != re->rxTail || re->txDoneReceived)
+            return 0; // interrupt data not yet processed
+    }
+    
+    if (_nextWakeup == (uint32_t)~0)
+        return -1;
+    
+    uint32_t tstamp = ticker->read_ms();
+    if (_nextWakeup <= tstamp)
+        return 0;
+    return _nextWakeup - tstamp;
+}
+
+
 void
 IRAM_ATTR RadioShuttle::TimeoutFunc()
 {
@@ -2013,13 +3496,21 @@ IRAM_ATTR RadioShuttle::TimeoutFunc()
 uint32_t
 RadioShuttle::GetDataSum(int maxbits, void *data, int len)
 {
-    uint8_t *p = (uint8_t *)data;
-    int32_t sum = 0;
-    while(len--)
-        sum += *p++;
-    // Limit to the number of requested bits, carry over the remaining
-    sum = (sum & ((1<<maxbits)-1)) + (sum >> maxbits);
-    return sum;
+    return DataSumFold(maxbits, DataSumAdd(0, data, len));
+}
+
+
+uint32_t
+RadioShuttle::DataSumAdd(uint32_t sum, const void *data, int len, void *dst)
+{
+    return rs_datasum_add(sum, data, len, dst);
+}
+
+
+uint32_t
+RadioShuttle::DataSumFold(int maxbits, uint32_t sum)
+{
+    return rs_datasum_fold(maxbits, sum);
 }
 
 
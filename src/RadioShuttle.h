@@ -44,6 +44,8 @@ using namespace std;
 #include "radio.h"
 #include "RadioStatusInterface.h"
 #include "RadioSecurityInterface.h"
+#include "RadioCompressionInterface.h"
+#include "RadioPool.h"
 
 #ifdef ARDUINO
 #define map	std::map // map clashes with Arduino map()
@@ -68,6 +70,7 @@ typedef enum RSErrorCode {
     RS_MessageSizeExceeded,			// Message size too long
     RS_InvalidParam,				// invalid parameter.
     RS_OutOfMemory,					// unable to allocate memory
+    RS_NoCompressionInterface,		// No RadioCompressionInterface added
 } RSCode;
 
 
@@ -88,6 +91,28 @@ public:
         int FrequencyOffset;// +/- in Hz
     };
     
+    /*
+     * A channel of the channel plan for data transfers, the channel
+     * number used in the protocol is the plan index + 1.
+     */
+    struct ChannelProfile {
+        int Frequency;      // in Hz
+        int SpreadingFaktor;// 7-12
+    };
+    
+    /*
+     * Number of preallocated entries for the send and receive queues,
+     * one PoolProfile per RadioType.
+     * A value of 0 uses the heap without a limit, the default for nodes.
+     * A reserved pool never falls back to the heap.
+     */
+    struct PoolProfile {
+        int SendEntries;	// Queued messages including responses
+        int RecvEntries;	// Received packets pending for processing
+        int AirtimeEntries;	// Overheard time on air slots
+        int ConnectEntries;	// Connections and their encryption contexts
+    };
+    
     enum RadioType {
 		RS_RadioType_Invalid = 0,
         RS_Node_Offline,   	// Sleep mode until sending, < 10k RAM
@@ -146,6 +171,10 @@ public:
         int protocolError;
         int noMemoryError;
         int decryptError;
+        int decompressError;
+        int rxOverflowCount;	// Received packets lost because the RX ring was full
+        int airtimeDeferCount;	// Sends delayed for an overheard response window
+        int channelSwitchCount;	// Data channel grants (station), channel switches (node)
 		int lastRSSI;
 		int lastSNR;
 		devid_t lastRXdeviceID;
@@ -197,8 +226,38 @@ public:
      * The external API interface has the advantage that the security
      * can be upgraded independently of the RadioShuttle library.
      * AES hardware accelleration can be one reason for it.
+     * The encryption contexts of the connections are kept in RadioShuttle
+     * memory if the interface supports InitEncryptionContext, otherwise
+     * they come from CreateEncryptionContext and the interface must be
+     * deleted after the RadioShuttle, which destroys them.
      */
     RSCode AddRadioSecurity(RadioSecurityInterface *securityIntf);
+    
+    /*
+     * Support function for message compression, the messages of
+     * apps with EnableCompression get compressed before the encryption.
+     */
+    RSCode AddRadioCompression(RadioCompressionInterface *compressionIntf);
+    
+    /*
+     * Sets custom pool sizes, the profile is an array indexed by the RadioType
+     * (RS_RadioType_Invalid to RS_Station_Server) and must stay valid.
+     * Must be called before Startup(), the pools are allocated on Startup().
+     * If a pool is exhausted SendMsg and Connect return RS_OutOfMemory.
+     */
+    RSCode SetPoolProfile(const struct PoolProfile *profile);
+    
+    /*
+     * Sets the channel plan (max 15 channels) which must be identical on
+     * stations and nodes, the plan must stay valid.
+     * The first radio of a station stays on the control channel of its profile,
+     * additional radios whose profile matches a plan channel serve this channel.
+     * Stations grant the data transfers of slot requests on an idle channel
+     * with the lowest spreading factor the SNR of the node allows,
+     * nodes switch their radio to it until the data is confirmed.
+     * Must be called before Startup().
+     */
+    RSCode SetChannelPlan(const struct ChannelProfile *plan, int count);
 
     /*
      * Starts the service with the specified RadioType
@@ -226,6 +285,33 @@ public:
      */
     RSCode DeRegisterApplication(int AppID);
     
+    /*
+     * Sends small queued messages of the AppID to the same station together
+     * in one frame, every message gets a 2 byte sub-header which reduces
+     * the maximum message size. The receiver calls the handler per message.
+     * Must be enabled for the AppID on the station and on the nodes.
+     */
+    RSCode EnableAggregation(int AppID, bool enable = true);
+    
+    /*
+     * Allows messages of the AppID up to maxMsgSize (max 2031) bytes, they
+     * are sent as a burst of up to 32 fragments within one send slot.
+     * Missing fragments are reported with the confirmation and sent again.
+     * The receiver reassembles the message in a buffer of maxMsgSize
+     * and calls the handler once, messages of the app are always confirmed.
+     * Must be enabled for the AppID on the station and on the nodes,
+     * it cannot be combined with the aggregation. 0 turns it off.
+     */
+    RSCode EnableFragmentation(int AppID, int maxMsgSize);
+    
+    /*
+     * Compresses the data frames of the AppID, a leading byte tells if
+     * the frame is compressed (compression version) or not (0).
+     * The maximum message size is one byte less. Must be enabled for the
+     * AppID on the station and on the nodes, with the same dictionary.
+     */
+    RSCode EnableCompression(int AppID, bool enable = true);
+    
     /*
      * Check if the password is specified for an app
      */
@@ -269,9 +355,11 @@ public:
     /*
      * Sets the size value to the largest messages available
      * for all configured radios
-     * The flags are important because encrypted messages need more space
+     * The flags are important because encrypted messages need more space,
+     * the size assumes security version 1 unless the connection
+     * of the AppID and stationID uses version 2.
      */
-    RSCode MaxMessageSize(int *size, int msgFlags = 0);
+    RSCode MaxMessageSize(int *size, int msgFlags = 0, int AppID = 0, devid_t stationID = DEV_ID_ANY);
     
     /*
      * Get statistics of all messages and errors
@@ -292,6 +380,15 @@ public:
      */
     bool Idle(bool forceBusyDuringTransmits = false);
     
+    /*
+     * Returns the number of ms until the RunShuttle needs to be called again
+     * for send retries, response windows, confirm timeouts or TX guard times.
+     * Returns 0 if the RunShuttle should be called immediately and -1 if
+     * only radio interrupts or new messages require the RunShuttle.
+     * This allows the main loop to sleep exactly until the next deadline.
+     */
+    int NextWakeup(void);
+    
     /*
      * Converts a RadioShuttle error code into a string.
      */
@@ -320,7 +417,11 @@ private:
         PS_SendTimeout,
     };
 
+    const static int RX_RING_SLOTS = 4; // Received packet slots per radio, power of two
+    const static int OVERHEARD_REQUESTS = 4; // Overheard request sizes per radio
+    
     struct RadioEntry; // forward decl.
+    struct SendMsgEntry;
     struct ReceivedMsgEntry {
         void *RxData;
         int RxSize;
@@ -329,6 +430,16 @@ private:
         struct RadioEntry *re;
     };
     
+    /*
+     * The size of a request overheard from a node to another station,
+     * the response of the station grants the node a send slot for it.
+     */
+    struct OverheardRequest {
+        devid_t source;
+        int AppID;
+        int len;
+    };
+    
 
     struct RadioEntry {
         Radio *radio;
@@ -336,10 +447,27 @@ private:
         const RadioProfile *profile;
         RadioModems_t modem;
         volatile signed char _CADdetected;
+        bool cadRunning;	// CadDetection started, waiting for RS_CadDone
+        uint32_t cadStartTime;
         uint16_t lastTxSize;
         int lastTxPower;
         int timeOnAir12Bytes;
-        struct ReceivedMsgEntry rxMsg;
+        /*
+         * Single producer (RS_RxDone interrupt), single consumer (RunShuttle) ring
+         * of received packets, the payload is copied into rxBuffer on interrupt level.
+         * The interrupt only writes rxHead, the RunShuttle only writes rxTail.
+         */
+        struct ReceivedMsgEntry rxRing[RX_RING_SLOTS];
+        uint8_t *rxBuffer;
+        int rxBufferSize;
+        volatile uint8_t rxHead;
+        volatile uint8_t rxTail;
+        struct OverheardRequest requests[OVERHEARD_REQUESTS];
+        uint8_t nextRequest;	// The oldest requests entry, replaced next
+        uint8_t rxPending;	// rxHead of the packets added to _recvs
+        uint8_t *txBuffer;	// MTU sized scratch buffer for encrypted packets
+        int txBufferSize;
+        uint8_t *zBuffer;	// MTU sized buffer for compressed sends and decompressed receives
         struct RadioStats rStats;
         int maxTimeOnAir;
         int retry_ms;
@@ -349,6 +477,11 @@ private:
         volatile const char *intrDelayedMsg;
         uint32_t random;
         uint32_t random2;
+        uint8_t dataChannel;		// Station: plan channel served by this radio, 0 for the control channel
+        uint32_t channelBusyUntil;	// Station: end of the last data transfer granted on this radio
+        uint8_t channel;			// Node: current channel and factor, 0 for the profile
+        uint8_t factor;
+        SendMsgEntry *channelMsg; // Node: message in the data phase on the switched channel
     };
     
     struct AppEntry {
@@ -358,6 +491,9 @@ private:
         void *password;
         uint8_t pwLen;
         bool pwdConnected;
+        bool aggregate;	// Data frames contain AggregateHeader and message pairs
+        int fragmentSize;	// Maximum reassembled message size, 0 without fragmentation
+        bool compress;	// Data frames start with the compression version or 0
     };
     
     struct ConnectEntry {
@@ -365,6 +501,18 @@ private:
         int AppID;
         bool authorized;
         uint32_t random[2];
+        void *context;	// Encryption context with the session key, valid while authorized
+        /*
+         * The security version is the lower version of both sides, it is
+         * exchanged during the Connect, version 1 peers do not send it.
+         * Nodes send their version only after the station offered its
+         * version with the confirmation of a previous Connect.
+         */
+        uint8_t secVersion;
+        uint8_t peerVersion;	// Version offered by the station (nodes)
+        uint32_t nodeRandom[2];	// Nonce of the node sent with a version 2 Connect
+        uint32_t txSeq;	// Last sent sequence (version 2), never reused for a key
+        uint32_t rxSeq;	// Last received sequence (version 2), reset with a new random
     };
     
     struct SendMsgEntry {
@@ -386,10 +534,32 @@ private:
         uint32_t lastTimeOnAir;
         uint32_t confirmTimeout;
         int retry_ms;
-        uint8_t channel;
+        uint8_t channel;	// Data channel and factor of the send slot
         uint8_t factor;
-        uint32_t securityData[8];
+        uint8_t radioChannel;	// Station: send via the radios serving this channel
+        uint32_t securityData[11];	// Password hash, our security version and nonce
         uint32_t tmpRandom[2];
+        uint32_t dueTime;	// Next time the entry needs processing, key in _schedule
+        uint32_t dueSeq;	// Unique sequence number, second key in _schedule
+        bool inFlight;		// Counted in _inflight, the status is beyond PS_Queued
+        bool waitResponse;	// Listed in _responses, a response is expected
+        /*
+         * Aggregation: the first message keeps the frame and the chain of the
+         * other messages which are removed from the _schedule and share its result.
+         */
+        SendMsgEntry *aggrNext;
+        uint8_t *aggrData;
+        int aggrLen;
+        bool aggregated;	// Sent within the frame of another message
+        /*
+         * Fragmentation: the data per fragment, the next fragment of the burst
+         * and the fragments confirmed by the receiver.
+         */
+        uint8_t *fragData;	// FragmentHeader and data of the current fragment
+        int fragSize;
+        uint8_t fragCount;
+        uint8_t fragNext;
+        uint32_t fragAcked;
     };
     
     struct SignalStrengthEntry {
@@ -397,9 +567,22 @@ private:
         devid_t stationID;
         time_t lastUpdate;
         int rcnCnt;
+        int snr10;		// Smoothed SNR (1/10 dB), drops are taken immediately
+        /*
+         * Closed loop TX power control towards the station
+         */
+        int txPower;		// dBm, 0 for the profile power
+        int txDelivered;	// Deliveries since the last power change
+        int slotMsgID;		// Station: msgID of the last granted slot, -1 if the data arrived
     };
     
+    /*
+     * The expected transmission of another station which got a send slot
+     * via an overheard response, the channel is busy from busy_time on
+     * for busy_ms on the radio which overheard the response.
+     */
     struct TimeOnAirSlotEntry {
+        RadioEntry *re;
         devid_t stationID;
         int AppID;
         uint8_t channel;
@@ -408,6 +591,12 @@ private:
         int busy_ms;
     };
     
+    typedef list<SendMsgEntry, RadioPoolAllocator<SendMsgEntry> > SendMsgList;
+    typedef list<ReceivedMsgEntry, RadioPoolAllocator<ReceivedMsgEntry> > ReceivedMsgList;
+    typedef list<TimeOnAirSlotEntry, RadioPoolAllocator<TimeOnAirSlotEntry> > TimeOnAirSlotList;
+    typedef map<pair<devid_t,int>, ConnectEntry, std::less<pair<devid_t,int> >,
+        RadioPoolAllocator<std::pair<const pair<devid_t,int>, ConnectEntry> > > ConnectMap;
+    
     struct EncryptionHeader {
         uint32_t version : 3;	// 3-bit encryption version
 		uint32_t dataSum : 13;	// Checksum of all packet data
@@ -416,6 +605,47 @@ private:
         uint32_t random;
     };
     
+    struct AggregateHeader {
+        uint16_t msgSize : 11;	// Message data following the header
+        uint16_t msgID   : 5;	// msgID of the message
+    };
+    
+    struct FragmentHeader {
+        uint16_t msgSize : 11;	// Size of the complete message
+        uint16_t index   : 5;	// Fragment number
+        uint16_t offset  : 11;	// Position of the fragment data in the message
+        uint16_t last    : 5;	// Number of the last fragment
+    };
+    
+    /*
+     * A message in reassembly, one per station and AppID.
+     * The msgID repeats after 32 messages, the fragment sums tell a
+     * repeated fragment from one of a new message.
+     */
+    struct ReassemblyEntry {
+        int msgID;
+        int msgSize;
+        uint32_t missing;	// Bitmap of the fragments not yet received
+        uint8_t *buffer;
+        uint32_t lastUpdate;
+        uint16_t sums[32];	// GetDataSum of every received fragment (MaxFragments)
+    };
+    
+    /*
+     * A received Connect password waiting for the station batch verification
+     */
+    struct ConnectVerifyEntry {
+        RadioEntry *re;
+        int AppID;
+        devid_t source;
+        int msgID;
+        int msgFlags;
+        uint32_t random[2];	// The connection randoms the hash was made with
+        uint32_t received;
+        int len;
+        uint8_t data[64 + 1 + 8];	// The hash, version and node nonce
+    };
+    
     enum RadioHeaderVersions {
         RSMagic					= 0b1011,
         RSHeaderFully_v1 		= 0b001,
@@ -428,7 +658,17 @@ private:
         Fullyv1MaxRespWindow 	= (1<<16)-1,
         Packedv1MaxDeviceID 	= (1<<21)-1,
         MaxWinScale				= (1<<4)-1,
+        MaxDataChannels			= (1<<4)-1,
+        SpreadingFactorBase		= 5,	// Header factor 1-7 is the spreading factor 6-12
+        MaxFragments			= 32,
+        MaxFragmentedSize		= (1<<11)-1-RSHeaderFullySize_v1,	// 2031 bytes, see EnableFragmentation
         DataSumBits				= 13,
+        SecurityVersion_v1		= 1,	// AES-ECB with EncryptionHeader, padded to the block size
+        SecurityVersion_v2		= 2,	// Authenticated encryption, sequence and tag, no padding
+        SecuritySeqSize_v2		= 4,
+        SecurityTagSize_v2		= 4,
+        SecurityNonceSize_v2	= 12,
+        ConnectExtSize			= 1 + 8,	// Connect data after the hash: version and node nonce
     };
     
     /*
@@ -497,8 +737,11 @@ private:
      * This takes a few ms (at SF7) and the interrupt RS_CadDone will report
      * the status.
      * The radio->_CADdetected contains the result (0 for idle, 1 for busy)
+     * The CadDetection does not wait for the result, it returns true while the
+     * CAD is running or the channel is busy. The RS_CadDone interrupt wakes
+     * up the RunShuttle which calls the CadDetection again to get the result.
      */
-    bool CadDetection(RadioEntry *re);
+    bool CadDetection(RadioEntry *re, uint32_t tstamp);
     
     /*
      * init the RX/TX of the Radio.
@@ -515,7 +758,125 @@ private:
     
     void MessageSecurityError(ReceivedMsgEntry *rme, AppEntry *aep, int msgID, devid_t source, uint8_t channel, uint8_t factor);
     
-    void SaveTimeOnAirSlot(devid_t destination, int AppID, int msgFlags, int respWindow, uint8_t channel, uint8_t factor, int timeOnAir);
+    /*
+     * Sets the authorization state of a connection, an authorized connection
+     * gets a ready to use encryption context which is kept until the
+     * connection gets authorized again or removed.
+     * The nodeID is the device which sent the Connect.
+     */
+    void AuthorizeConnection(ConnectEntry *cep, AppEntry *aep, bool authorized, devid_t nodeID);
+    /*
+     * The data size announced in the Connect slot request, the hash
+     * plus ConnectExtSize tells the station that we support version 2.
+     */
+    int ConnectMsgSize(void);
+    /*
+     * Encryption contexts of _contextSize bytes come from the _contextPool,
+     * or the heap without a reserved pool, and get released without the
+     * security interface. Interfaces without InitEncryptionContext
+     * (_contextSize 0) use CreateEncryptionContext.
+     */
+    void *CreateConnectionContext(void *key, int keyLen);
+    void DestroyConnectionContext(void *context);
+    /*
+     * The version 2 nonce is unique per key: the connection random,
+     * the sending station and its sequence number.
+     */
+    void SecurityNonce(ConnectEntry *cep, devid_t sender, uint32_t seq, uint8_t *nonce);
+    
+    /*
+     * The _airtimes are the reservation table of overheard send slots,
+     * ordered by their end time that expired entries are removed
+     * from the front. AirtimeReserved returns the end of a reservation
+     * on the radio overlapping a send of timeOnAir ms starting at tstamp,
+     * otherwise 0.
+     */
+    void SaveTimeOnAirSlot(RadioEntry *re, devid_t destination, int AppID, int msgFlags, int respWindow, uint8_t channel, uint8_t factor, int timeOnAir);
+    void PruneAirtimes(uint32_t tstamp);
+    uint32_t AirtimeReserved(RadioEntry *re, uint32_t tstamp, int timeOnAir);
+    
+    /*
+     * Grants the data transfer of a slot request received on the control
+     * channel radio rre on the idle data channel radio, which is reserved for
+     * the data and its confirmation. Returns false if all channels are busy.
+     * The spreading factor of the node only selects among the data channel
+     * radios, each one receives the single factor of its plan channel.
+     * Stations without data channel radios keep the control channel factor.
+     */
+    bool AssignDataChannel(RadioEntry *rre, int len, SendMsgEntry *mep);
+    /*
+     * Reconfigures a node radio to a plan channel and factor, channel and
+     * factor 0 return to the radio profile. The radio is left receiving.
+     */
+    bool SwitchChannel(RadioEntry *re, uint8_t channel, uint8_t factor);
+    
+    /*
+     * All queued messages are kept in the _schedule ordered by their next
+     * due time, this avoids scanning all _sends in the RunShuttle.
+     * ScheduleMsg must be called once after an entry has been added to the _sends,
+     * RescheduleMsg must be called after the status or timing of an entry changed.
+     * UnscheduleMsg must be called before an entry gets removed from the _sends.
+     * The scheduling also maintains the _inflight index of messages beyond PS_Queued
+     * and the _responses index of messages waiting for a response.
+     */
+    void ScheduleMsg(SendMsgList::iterator me);
+    void RescheduleMsg(SendMsgEntry *mep);
+    void UnscheduleMsg(SendMsgEntry *mep);
+    uint32_t GetDueTime(SendMsgEntry *mep);
+    void UpdateMsgIndex(SendMsgEntry *mep, bool indexed);
+    /*
+     * Builds the frame of a message of an aggregating app, compatible
+     * queued messages to the same station are added as long as they fit.
+     */
+    bool AggregateMsgs(SendMsgEntry *mep);
+    /*
+     * The largest data of a single frame of the app, the smaller security
+     * version 1 is assumed unless the connection uses version 2.
+     */
+    int MaxFrameSize(AppEntry *aep, int flags, ConnectEntry *cep);
+    /*
+     * Compression of the data frames, the result is placed in the zBuffer.
+     * Returns false without memory or for invalid compressed data.
+     * Sends and receives share the zBuffer of the radio, this is safe
+     * because RunShuttle is not reentered (busyInShuttle), SendMessage
+     * copies the compressed frame into the txBuffer and received data
+     * is passed to the handler before the buffer is used again.
+     */
+    bool CompressFrame(RadioEntry *re, int AppID, void **data, int *len);
+    bool DecompressFrame(RadioEntry *re, int AppID, void **data, int *len);
+    /*
+     * Fragmentation: NextFragment returns the first unconfirmed fragment
+     * from index on, BuildFragment prepares it in fragData and returns its size.
+     * ReassembleFragment collects a received fragment, it calls the handler
+     * for the complete message and returns the bitmap of the missing fragments,
+     * false for invalid fragments.
+     */
+    int NextFragment(SendMsgEntry *mep, int index);
+    int BuildFragment(SendMsgEntry *mep, int index);
+    bool ReassembleFragment(ReceivedMsgEntry *rme, AppEntry *aep, devid_t source, int msgID, void *data, int len, uint32_t *missing);
+    
+    /*
+     * Finds the message for a received response via the _responses index,
+     * the key is the station, the AppID and the 5-bit msgID of the header.
+     */
+    SendMsgEntry *FindResponseMsg(devid_t source, int AppID, int msgID);
+    uint64_t ResponseKey(devid_t stationID, int AppID, int msgID);
+    
+    /*
+     * Reports the final message status to the app and removes the message.
+     */
+    void CompleteMsg(SendMsgList::iterator me);
+    /*
+     * Removes a message without a status to the app (KillMsg, DeRegisterApplication).
+     * The messages aggregated into its frame get scheduled again on their own,
+     * an aggregated message is unlinked from the frame.
+     */
+    void RemoveMsg(SendMsgList::iterator me);
+    /*
+     * Releases the frame of an aggregating message, the messages taken
+     * along are scheduled again.
+     */
+    void SplitFrame(SendMsgEntry *mep);
     
     /*
      * Our main send function is responsible for header packing,
@@ -528,10 +889,19 @@ private:
      * We keep a little cache list of the power needed for different stations
      * This saves a lot of energy and reduces signal strength to keep the network
      * less busy. For example, other radio networks need not receive our signals.
+     * UpdateTXPower is called for every delivered or lost packet, the power
+     * goes down after TXP_DELIVERIES deliveries if the SNR margin allows it
+     * and up on a loss.
      */
     int CalculateTXPower(RadioEntry *re, devid_t stationID);
-    bool UpdateSignalStrength(devid_t stationID, int dBm);
+    void UpdateTXPower(RadioEntry *re, devid_t stationID, bool delivered);
+    bool UpdateSignalStrength(devid_t stationID, int dBm, int snr);
     bool DeleteSignalStrength(devid_t stationID);
+    /*
+     * The lowest spreading factor whose demodulation limit is SF_SNR_MARGIN
+     * below the measured SNR of the station, defaultSF if not yet known.
+     */
+    int CalculateSpreadingFactor(devid_t stationID, int defaultSF);
     
     
     /*
@@ -546,6 +916,21 @@ private:
      * because the data is only temporarily available until the next packet.
      */
     void ProcessReceivedMessages(void);
+    /*
+     * Verifies the queued connect passwords together, when the batch is full,
+     * no other packet is being received or the oldest waited BATCH_VERIFY_MS.
+     * force verifies them in any case.
+     */
+    void BatchVerifyConnects(bool force);
+    /*
+     * Completes a Connect request after the password verification,
+     * stale entries of an older Connect are ignored.
+     */
+    void ConnectVerified(ConnectVerifyEntry *vep, bool verified);
+    /*
+     * Queues the confirm of a received message, the data (max. securityData) is copied.
+     */
+    void QueueConfirm(RadioEntry *re, AppEntry *aep, devid_t source, int msgID, int flags, const void *data, int len);
     
     
     void PacketTrace(RadioEntry *re, const char *name, RadioHeader *rh, void *data, int len, bool sent, ReceivedMsgEntry *rme);
@@ -556,7 +941,20 @@ private:
      */
     void TimeoutFunc(void);
     
+    /*
+     * Calculates the absolute time (ticker ms) of the nearest deadline of all
+     * scheduled messages, TX guard times and CAD timeouts, ~0 for none.
+     */
+    uint32_t PlanWakeup(uint32_t txGuardEnd);
+    
     uint32_t GetDataSum(int maxbits, void *data, int len);
+    /*
+     * The running byte sum of GetDataSum, calculated four bytes at a time.
+     * If dst is set the data gets copied in the same pass.
+     * DataSumFold limits it to maxbits like GetDataSum.
+     */
+    uint32_t DataSumAdd(uint32_t sum, const void *data, int len, void *dst = NULL);
+    uint32_t DataSumFold(int maxbits, uint32_t sum);
     
     
 private:
@@ -566,23 +964,53 @@ private:
     int _maxMTUSize;
     list<RadioEntry> _radios;
     map<int, AppEntry> _apps;
-    map<std::pair<devid_t,int>, ConnectEntry> _connections;
-    list<SendMsgEntry> _sends;
-    list<ReceivedMsgEntry> _recvs;
+    RadioPool _sendPool;
+    RadioPool _recvPool;
+    RadioPool _airtimePool;
+    RadioPool _connectPool;
+    RadioPool _contextPool;	// Encryption contexts of the connections
+    int _contextSize;
+    ConnectMap _connections;
+    SendMsgList _sends;
+    map<pair<uint32_t,uint32_t>, SendMsgList::iterator> _schedule; // dueTime, dueSeq
+    uint32_t _scheduleSeq;
+    uint32_t _lastScheduleTime;
+    map<pair<int,devid_t>, int> _inflight; // AppID, stationID: number of messages in transit
+    multimap<uint64_t, SendMsgEntry *> _responses; // see ResponseKey()
+    ReceivedMsgList _recvs;
     map<devid_t, SignalStrengthEntry> _signals;
-    list<TimeOnAirSlotEntry> _airtimes;
+    TimeOnAirSlotList _airtimes;
+    map<pair<devid_t,int>, ReassemblyEntry> _reassembly; // stationID, AppID
+    ConnectVerifyEntry *_verifies;	// Stations only, MAX_BATCH_VERIFY entries
+    int _verifyCount;
     MyTimeout *timer;
     MyTimer *ticker;
     volatile uint32_t prevWakeup;
+    uint32_t _nextWakeup;	// Result of the last PlanWakeup
     int SetTimerCount;
     
     static const RadioProfile defaultProfile[];
+    static const PoolProfile defaultPoolProfile[];
+    const PoolProfile *_poolProfile;
+    const ChannelProfile *_channelPlan;
+    int _channelPlanCount;
     volatile bool busyInShuttle;
     WireDumpSettings _wireDumpSettings;
     const static int MAX_SENT_RETRIES = 3;	// Defines the number of retries of sents (with confirm)
     const static int RX_TIMEOUT_30MIN = 30*60*1000; // Mbed OS timers do not allow more 2^31-1 us
+    const static int CAD_TIMEOUT_MS = 50; // Give up waiting for RS_CadDone, the channel is considered free
+    const static int MAX_BATCH_VERIFY = 16; // Connect passwords verified together
+    const static int BATCH_VERIFY_MS = 50;	// Max. wait for more Connect passwords
+    const static int SF_SNR_MARGIN = 10; // dB above the SNR limit of a spreading factor
+    const static int MAX_REASSEMBLY = 4;	// Messages in reassembly, the oldest gets dropped
+    const static int TXP_SNR_MARGIN = 5;	// dB above the SNR limit for lowering the TX power
+    const static int TXP_DELIVERIES = 4;	// Deliveries before the TX power goes down
+    const static int TXP_STEP_DOWN = 2;		// dB
+    const static int TXP_STEP_UP = 6;		// dB
+    const static int TXP_MIN_POWER = 2;		// dBm
     RadioStatusInterface *_statusIntf;
     RadioSecurityInterface *_securityIntf;
+    RadioCompressionInterface *_compressionIntf;
     AppStartupHandler _startupHandler;
     AppStartupHandler _receiveHandler;
 };
@@ -21,6 +21,18 @@ extern "C" {
  #define ECB_MODE
 #endif
 
+// AES128_TTABLE 1 selects the 32-bit T-table implementation which is several
+// times faster but needs 2 kB of tables and 352 bytes more per context.
+// The default is the small byte oriented implementation on MCUs (Arduino, mbed),
+// and the T-table implementation on host systems (e.g. Linux gateways).
+#ifndef AES128_TTABLE
+ #if defined(ARDUINO) || defined(__MBED__)
+  #define AES128_TTABLE 0
+ #else
+  #define AES128_TTABLE 1
+ #endif
+#endif
+
 /*****************************************************************************/
 /* Private variables:                                                        */
 /*****************************************************************************/
@@ -36,6 +48,10 @@ typedef uint8_t state_t[4][4];
 typedef struct {
     state_t* state;
 	uint8_t RoundKey[176];	// The array that stores the round keys
+#if AES128_TTABLE
+    uint32_t EncKey[4 * (Nr + 1)];	// Round keys as big endian words
+    uint32_t DecKey[4 * (Nr + 1)];	// Round keys for the equivalent inverse cipher
+#endif
 #ifdef CBC_MODE
     // uint8_t* Iv;
     uint8_t InitialVector[AES128_KEYLEN]; // Initial Vector used only for CBC mode
@@ -0,0 +1,53 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#include <string.h>
+#include "rs_datasum.h"
+
+uint32_t rs_datasum_add(uint32_t sum, const void *data, int len, void *dst)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint8_t *d = (uint8_t *)dst;
+
+	/*
+	 * Each word adds its bytes 0+1 and 2+3 into two 16-bit lanes,
+	 * 128 words (max 128*510) fit into a lane before it gets added to the sum.
+	 */
+	while (len >= 4) {
+		int words = len / 4 > 128 ? 128 : len / 4;
+		uint32_t lanes = 0;
+		len -= words * 4;
+		if (d) {
+			while (words--) {
+				uint32_t w;
+				memcpy(&w, p, sizeof(w));
+				memcpy(d, &w, sizeof(w));
+				lanes += (w & 0x00ff00ff) + ((w >> 8) & 0x00ff00ff);
+				p += sizeof(w);
+				d += sizeof(w);
+			}
+		} else {
+			while (words--) {
+				uint32_t w;
+				memcpy(&w, p, sizeof(w));
+				lanes += (w & 0x00ff00ff) + ((w >> 8) & 0x00ff00ff);
+				p += sizeof(w);
+			}
+		}
+		sum += (lanes & 0xffff) + (lanes >> 16);
+	}
+	while (len-- > 0) {
+		if (d)
+			*d++ = *p;
+		sum += *p++;
+	}
+	return sum;
+}
+
+uint32_t rs_datasum_fold(int maxbits, uint32_t sum)
+{
+	return (sum & ((1 << maxbits) - 1)) + (sum >> maxbits);
+}
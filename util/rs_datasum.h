@@ -0,0 +1,25 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef RS_DATASUM_H
+#define RS_DATASUM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Adds the bytes to a running sum, if dst is set the data is copied in the same pass
+uint32_t rs_datasum_add(uint32_t sum, const void *data, int len, void *dst);
+// Limits the sum to maxbits, the remaining bits are carried over once
+uint32_t rs_datasum_fold(int maxbits, uint32_t sum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RS_DATASUM_H
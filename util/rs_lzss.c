@@ -0,0 +1,97 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#include "rs_lzss.h"
+
+#define LZSS_AT(pos)	((pos) < dictlen ? dict[pos] : in[(pos) - dictlen])
+
+int rs_lzss_compress(const uint8_t *dict, int dictlen, const uint8_t *in, int len, uint8_t *out, int maxlen)
+{
+	int op = 0;
+	int flagpos = 0;
+	int bit = 8;
+	int i = 0;
+
+	if (!dict)
+		dictlen = 0;
+	while (i < len) {
+		if (bit == 8) {
+			if (op >= maxlen)
+				return -1;
+			flagpos = op;
+			out[op++] = 0;
+			bit = 0;
+		}
+		/*
+		 * The nearest match wins on equal length, the search stops
+		 * at the maximum length. Messages are short, no hash chains needed.
+		 */
+		int pos = dictlen + i;
+		int start = pos > LZSS_WINDOW ? pos - LZSS_WINDOW : 0;
+		int maxmatch = len - i < LZSS_MAX_MATCH ? len - i : LZSS_MAX_MATCH;
+		int bestlen = 0;
+		int bestdist = 0;
+		for (int s = pos - 1; s >= start && bestlen < maxmatch; s--) {
+			if (LZSS_AT(s) != in[i])
+				continue;
+			int l = 1;
+			while (l < maxmatch && LZSS_AT(s + l) == in[i + l])
+				l++;
+			if (l > bestlen) {
+				bestlen = l;
+				bestdist = pos - s;
+			}
+		}
+		if (bestlen >= LZSS_MIN_MATCH) {
+			if (op + 2 > maxlen)
+				return -1;
+			out[flagpos] |= 1 << bit;
+			out[op++] = (bestdist - 1) & 0xff;
+			out[op++] = ((bestdist - 1) >> 8) | ((bestlen - LZSS_MIN_MATCH) << 2);
+			i += bestlen;
+		} else {
+			if (op >= maxlen)
+				return -1;
+			out[op++] = in[i++];
+		}
+		bit++;
+	}
+	return op;
+}
+
+
+int rs_lzss_decompress(const uint8_t *dict, int dictlen, const uint8_t *in, int len, uint8_t *out, int maxlen)
+{
+	int ip = 0;
+	int op = 0;
+
+	if (!dict)
+		dictlen = 0;
+	while (ip < len) {
+		uint8_t flags = in[ip++];
+		for (int bit = 0; bit < 8 && ip < len; bit++) {
+			if (flags & (1 << bit)) {
+				if (ip + 2 > len)
+					return -1;
+				int dist = (in[ip] | ((in[ip + 1] & 0x03) << 8)) + 1;
+				int l = (in[ip + 1] >> 2) + LZSS_MIN_MATCH;
+				ip += 2;
+				if (dist > dictlen + op || op + l > maxlen)
+					return -1;
+				// byte by byte, the match may overlap the output
+				for (int k = 0; k < l; k++, op++) {
+					int s = dictlen + op - dist;
+					out[op] = s < dictlen ? dict[s] : out[s - dictlen];
+				}
+			} else {
+				if (op >= maxlen)
+					return -1;
+				out[op++] = in[ip++];
+			}
+		}
+	}
+	return op;
+}
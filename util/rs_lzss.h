@@ -0,0 +1,34 @@
+/*
+ * The file is licensed under the Apache License, Version 2.0
+ * (c) 2019 Helmut Tschemernjak
+ * 30826 Garbsen (Hannover) Germany
+ */
+
+#ifndef RS_LZSS_H
+#define RS_LZSS_H
+
+#include <stdint.h>
+
+/*
+ * LZSS for short radio messages, a flag byte announces the following
+ * eight literals (bit 0) or matches (bit 1). A match has two bytes,
+ * a 10-bit distance and a 6-bit length.
+ */
+#define LZSS_WINDOW		1024
+#define LZSS_MIN_MATCH	3
+#define LZSS_MAX_MATCH	(LZSS_MIN_MATCH + 63)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The optional dict is the history in front of the data, returns the size or -1 if maxlen is exceeded
+int rs_lzss_compress(const uint8_t *dict, int dictlen, const uint8_t *in, int len, uint8_t *out, int maxlen);
+// Returns the size or -1 for invalid data or if maxlen is exceeded
+int rs_lzss_decompress(const uint8_t *dict, int dictlen, const uint8_t *in, int len, uint8_t *out, int maxlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RS_LZSS_H
@@ -156,3 +156,168 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
 	}
 }
+
+/*********************** MULTI-BUFFER HASHING ***********************/
+/*
+ * sha256_multi hashes up to SHA256_LANES messages in parallel, every vector
+ * element is one message (lane). The GCC/clang vector extension maps this
+ * to SSE2/AVX2 on x86, NEON on ARM and interleaved scalar code elsewhere.
+ * Other compilers hash the messages one after the other.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+
+typedef WORD sha256_vec __attribute__((vector_size(SHA256_LANES * sizeof(WORD))));
+
+#define VROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
+#define VEP0(x) (VROTRIGHT(x,2) ^ VROTRIGHT(x,13) ^ VROTRIGHT(x,22))
+#define VEP1(x) (VROTRIGHT(x,6) ^ VROTRIGHT(x,11) ^ VROTRIGHT(x,25))
+#define VSIG0(x) (VROTRIGHT(x,7) ^ VROTRIGHT(x,18) ^ ((x) >> 3))
+#define VSIG1(x) (VROTRIGHT(x,17) ^ VROTRIGHT(x,19) ^ ((x) >> 10))
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__) && __GNUC__ >= 6
+#define SHA256_LANES_TARGET __attribute__((target_clones("avx2","default")))
+#else
+#define SHA256_LANES_TARGET
+#endif
+
+SHA256_LANES_TARGET
+static void sha256_transform_lanes(sha256_vec state[8], BYTE blocks[SHA256_LANES][64])
+{
+	sha256_vec a, b, c, d, e, f, g, h, t1, t2, m[16];
+	int i, lane;
+
+	for (i = 0; i < 16; ++i) {
+		for (lane = 0; lane < SHA256_LANES; ++lane) {
+			const BYTE *p = blocks[lane] + i * 4;
+			m[i][lane] = ((WORD)p[0] << 24) | ((WORD)p[1] << 16) | ((WORD)p[2] << 8) | (WORD)p[3];
+		}
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (i = 0; i < 64; ++i) {
+		if (i >= 16) // the message schedule is kept in a rolling window of 16 words
+			m[i & 15] += VSIG1(m[(i - 2) & 15]) + m[(i - 7) & 15] + VSIG0(m[(i - 15) & 15]);
+		t1 = h + VEP1(e) + ((e & f) ^ (~e & g)) + k[i] + m[i & 15];
+		t2 = VEP0(a) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/*
+ * Builds block number blk of the padded message, the last block
+ * contains the bit length.
+ */
+static void sha256_job_block(const SHA256_JOB *job, size_t total, size_t nblocks, size_t blk, BYTE block[64])
+{
+	size_t off = blk * 64, end = off + 64, n;
+	int i;
+
+	memset(block, 0, 64);
+	if (off < job->len[0]) { // first part
+		n = (job->len[0] < end ? job->len[0] : end) - off;
+		memcpy(block, job->data[0] + off, n);
+	}
+	if (job->len[1] && end > job->len[0] && off < total) { // second part, may be empty (NULL)
+		size_t from = off > job->len[0] ? off : job->len[0];
+		n = (total < end ? total : end) - from;
+		memcpy(block + (from - off), job->data[1] + (from - job->len[0]), n);
+	}
+	if (total >= off && total < end)
+		block[total - off] = 0x80;
+	if (blk == nblocks - 1) {
+		unsigned long long bitlen = (unsigned long long)total * 8;
+		for (i = 0; i < 8; ++i)
+			block[63 - i] = bitlen >> (i * 8);
+	}
+}
+
+void sha256_multi(SHA256_JOB *jobs, int count)
+{
+	static const WORD init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	BYTE blocks[SHA256_LANES][64];
+	size_t total[SHA256_LANES], nblocks[SHA256_LANES], maxblocks, blk;
+	sha256_vec state[8];
+	int i, lane, lanes;
+
+	for ( ; count > 0; jobs += lanes, count -= lanes) {
+		lanes = count < SHA256_LANES ? count : SHA256_LANES;
+		maxblocks = 0;
+		for (lane = 0; lane < SHA256_LANES; ++lane) {
+			total[lane] = 0;
+			nblocks[lane] = 0; // unused lanes hash zero blocks, the result is ignored
+			if (lane < lanes) {
+				total[lane] = jobs[lane].len[0] + jobs[lane].len[1];
+				nblocks[lane] = (total[lane] + 8) / 64 + 1;
+			}
+			if (nblocks[lane] > maxblocks)
+				maxblocks = nblocks[lane];
+			memset(blocks[lane], 0, sizeof(blocks[lane]));
+		}
+		for (i = 0; i < 8; ++i) {
+			for (lane = 0; lane < SHA256_LANES; ++lane)
+				state[i][lane] = init[i];
+		}
+
+		for (blk = 0; blk < maxblocks; ++blk) {
+			for (lane = 0; lane < lanes; ++lane) {
+				if (blk < nblocks[lane])
+					sha256_job_block(&jobs[lane], total[lane], nblocks[lane], blk, blocks[lane]);
+			}
+			sha256_transform_lanes(state, blocks);
+			for (lane = 0; lane < lanes; ++lane) {
+				if (blk != nblocks[lane] - 1)
+					continue;
+				for (i = 0; i < 8; ++i) {
+					WORD s = state[i][lane];
+					jobs[lane].hash[i * 4]     = s >> 24;
+					jobs[lane].hash[i * 4 + 1] = s >> 16;
+					jobs[lane].hash[i * 4 + 2] = s >> 8;
+					jobs[lane].hash[i * 4 + 3] = s;
+				}
+			}
+		}
+	}
+}
+
+#else
+
+void sha256_multi(SHA256_JOB *jobs, int count)
+{
+	SHA256_CTX ctx;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, jobs[i].data[0], jobs[i].len[0]);
+		sha256_update(&ctx, jobs[i].data[1], jobs[i].len[1]);
+		sha256_final(&ctx, jobs[i].hash);
+	}
+}
+
+#endif
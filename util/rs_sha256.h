@@ -30,10 +30,21 @@ typedef struct {
 	WORD state[8];
 } SHA256_CTX;
 
+// A message for sha256_multi, made of up to two parts (e.g. seed and password)
+typedef struct {
+	const BYTE *data[2];
+	size_t len[2];
+	BYTE *hash;                         // SHA256_BLOCK_SIZE bytes result
+} SHA256_JOB;
+
+// Number of messages hashed in parallel by sha256_multi
+#define SHA256_LANES 8
+
 /*********************** FUNCTION DECLARATIONS **********************/
 void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
+void sha256_multi(SHA256_JOB *jobs, int count);
 
 #ifdef __cplusplus
 }